@@ -0,0 +1,117 @@
+/*
+ * ae_timer.c -- ae time event overhead benchmark.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Arms N far-future timers and measures the cost of one aeProcessEvents
+ * pass (nearest timer search, a poll that returns at once because a pipe
+ * is always readable, and time event processing), plus the cost of arming
+ * and cancelling a timer with N already armed.
+ *
+ * Usage: ae_timer [iterations]
+ */
+
+#include "../lib/ae.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+static long long
+ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
+}
+
+static int
+timer_cb(struct aeEventLoop *el, long long id, void *ud) {
+    AE_NOTUSED(el);
+    AE_NOTUSED(id);
+    AE_NOTUSED(ud);
+    return AE_NOMORE;
+}
+
+static void
+readable_cb(struct aeEventLoop *el, int fd, void *ud, int mask) {
+    AE_NOTUSED(el);
+    AE_NOTUSED(fd);
+    AE_NOTUSED(ud);
+    AE_NOTUSED(mask);
+}
+
+static void
+bench(int timers, int iterations) {
+    aeEventLoop *el;
+    int i, fds[2];
+    long long start, loop_us, arm_us, id;
+
+    el = aeCreateEventLoop(64);
+    if (pipe(fds) == -1 || write(fds[1], "x", 1) != 1) {
+        perror("pipe");
+        exit(1);
+    }
+    aeCreateFileEvent(el, fds[0], AE_READABLE, readable_cb, 0);
+
+    for (i = 0; i < timers; i++) {
+        aeCreateTimeEvent(el, 3600*1000 + i, timer_cb, 0, 0);
+    }
+
+    start = ustime();
+    for (i = 0; i < iterations; i++) {
+        aeProcessEvents(el, AE_ALL_EVENTS);
+    }
+    loop_us = ustime() - start;
+
+    start = ustime();
+    for (i = 0; i < iterations; i++) {
+        id = aeCreateTimeEvent(el, 1800*1000, timer_cb, 0, 0);
+        aeDeleteTimeEvent(el, id);
+        aeProcessEvents(el, AE_TIME_EVENTS|AE_DONT_WAIT);
+    }
+    arm_us = ustime() - start;
+
+    printf("%8d timers: %10.1f ns/loop %10.1f ns/arm+cancel\n", timers,
+           loop_us * 1000.0 / iterations, arm_us * 1000.0 / iterations);
+
+    close(fds[0]);
+    close(fds[1]);
+    aeDeleteEventLoop(el);
+}
+
+int
+main(int argc, char *argv[]) {
+    int iterations = 1000;
+
+    if (argc > 1) iterations = atoi(argv[1]);
+    if (iterations <= 0) iterations = 1000;
+
+    printf("ae %s, %d iterations\n", aeGetApiName(), iterations);
+    bench(0, iterations);
+    bench(1000, iterations);
+    bench(10000, iterations);
+    bench(100000, iterations);
+    return 0;
+}
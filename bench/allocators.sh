@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# allocators.sh -- compare requests per second and memory use of the httpd
+# sample built against each allocator.
+#
+# Usage: bench/allocators.sh [conns] [requests] [body bytes]
+#
+# Run from a source tree prepared with ./autogen.sh but not configured in
+# place. Each allocator in ALLOCATORS is configured --with-allocator in its
+# own directory under BUILDDIR, those that fail to configure or build are
+# skipped. Memory is read from /proc/<pid>/status once the load stops:
+# VmHWM is the peak resident set, VmRSS what stays resident.
+
+CONNS=${1:-64}
+REQUESTS=${2:-5000}
+BODY=${3:-0}
+PORT=${PORT:-18180}
+SRCDIR=$(cd "$(dirname "$0")/.." && pwd)
+BUILDDIR=${BUILDDIR:-$SRCDIR/_allocators}
+ALLOCATORS=${ALLOCATORS:-"libc jemalloc tcmalloc"}
+# passed to httpd, e.g. "-t 4".
+SERVER_FLAGS=${SERVER_FLAGS:-}
+
+# the libtool wrapper execs the real binary, so the server is $1, or its
+# child if the wrapper forked first.
+server_pid() {
+    child=$(cat /proc/$1/task/*/children 2>/dev/null | awk '{ print $1; exit }')
+    echo ${child:-$1}
+}
+
+status() {
+    awk -v field="$2:" '$1 == field { print $2 }' /proc/$1/status
+}
+
+printf "%-10s %12s %12s %12s\n" allocator requests/sec "peak KB" "rss KB"
+for allocator in $ALLOCATORS; do
+    dir=$BUILDDIR/$allocator
+    mkdir -p $dir
+    if ! (cd $dir && $SRCDIR/configure --with-allocator=$allocator >configure.log 2>&1 \
+          && make >make.log 2>&1 && make bench >>make.log 2>&1); then
+        printf "%-10s skipped, see %s\n" $allocator $dir
+        continue
+    fi
+    $dir/httpd -p $PORT --quiet $SERVER_FLAGS &
+    pid=$!
+    sleep 1
+    server=$(server_pid $pid)
+    rps=$($dir/bench/httpd_bench -p $PORT -c $CONNS -n $REQUESTS -b $BODY | awk '/requests\/sec/ { print $1 }')
+    printf "%-10s %12s %12s %12s\n" $allocator "$rps" "$(status $server VmHWM)" "$(status $server VmRSS)"
+    kill $server
+    wait $pid 2>/dev/null
+    PORT=$((PORT+1))
+done
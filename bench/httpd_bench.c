@@ -0,0 +1,214 @@
+/*
+ * httpd_bench.c -- keep-alive http load generator.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Runs c client threads, each sending n requests over one keep-alive
+ * connection (reconnecting when the server closes it), and reports
+ * requests per second. With -P the read/write syscall counters of the
+ * server process are sampled from /proc/<pid>/io before and after the run
+ * and reported per request.
+ *
+ * Usage: httpd_bench [-h host] [-p port] [-c conns] [-n requests]
+ *                    [-b body bytes] [-P server pid]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static char *host = "127.0.0.1";
+static int port = 8080;
+static int conns = 8;
+static int requests = 10000;
+static int body = 0;
+static int pid = 0;
+
+static char *request;
+static int request_len;
+
+struct client {
+    pthread_t thread;
+    long ok;
+    long bad;
+};
+
+static long long
+ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
+}
+
+static int
+proc_io(long long *syscr, long long *syscw) {
+    char path[64], line[128];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/%d/io", pid);
+    if (!(fp = fopen(path, "r"))) return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        sscanf(line, "syscr: %lld", syscr);
+        sscanf(line, "syscw: %lld", syscw);
+    }
+    fclose(fp);
+    return 0;
+}
+
+static int
+client_connect(void) {
+    struct addrinfo hints, *res;
+    char service[8];
+    int fd, yes = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) return -1;
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd != -1 && connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd != -1) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    return fd;
+}
+
+/* reads one response, returns 1 if the server keeps the connection open,
+ * 0 if it closes it, -1 on error. */
+static int
+client_response(int fd, char *buff, int size) {
+    int n, len = 0, need = -1, keep = 1;
+    char *end, *p;
+
+    for (;;) {
+        n = read(fd, buff+len, size-len-1);
+        if (n <= 0) return need != -1 && len >= need ? 0 : -1;
+        len += n;
+        buff[len] = 0;
+        if (need == -1 && (end = strstr(buff, "\r\n\r\n"))) {
+            need = end-buff+4;
+            if ((p = strcasestr(buff, "\r\nContent-Length:"))) need += atoi(p+17);
+            if (strcasestr(buff, "\r\nConnection: close")) keep = 0;
+        }
+        if (need != -1 && len >= need) return keep;
+        if (len == size-1) return -1;
+    }
+}
+
+static void *
+client_run(void *ud) {
+    struct client *c = (struct client *)ud;
+    char buff[65536];
+    int i, fd = -1, rc;
+
+    for (i = 0; i < requests; i++) {
+        if (fd == -1 && (fd = client_connect()) == -1) {
+            c->bad++;
+            continue;
+        }
+        if (write(fd, request, request_len) != request_len
+            || (rc = client_response(fd, buff, sizeof(buff))) == -1) {
+            c->bad++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        c->ok++;
+        if (rc == 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd != -1) close(fd);
+    return 0;
+}
+
+int
+main(int argc, char *argv[]) {
+    struct client *clients;
+    long long start, elapsed, r0 = 0, w0 = 0, r1 = 0, w1 = 0;
+    long ok = 0, bad = 0;
+    int i, opt;
+
+    while ((opt = getopt(argc, argv, "h:p:c:n:b:P:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': conns = atoi(optarg); break;
+        case 'n': requests = atoi(optarg); break;
+        case 'b': body = atoi(optarg); break;
+        case 'P': pid = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: httpd_bench [-h host] [-p port] [-c conns] [-n requests]"
+                    " [-b body bytes] [-P server pid]\n");
+            return 1;
+        }
+    }
+    if (conns < 1) conns = 1;
+
+    request = malloc(256+body);
+    request_len = sprintf(request, "%s / HTTP/1.1\r\nHost: %s\r\nContent-Length: %d\r\n\r\n",
+                          body ? "POST" : "GET", host, body);
+    memset(request+request_len, 'x', body);
+    request_len += body;
+
+    clients = calloc(conns, sizeof(struct client));
+    if (pid && proc_io(&r0, &w0) == -1) {
+        fprintf(stderr, "can't read /proc/%d/io: %s\n", pid, strerror(errno));
+        pid = 0;
+    }
+    start = ustime();
+    for (i = 0; i < conns; i++)
+        pthread_create(&clients[i].thread, 0, client_run, &clients[i]);
+    for (i = 0; i < conns; i++) {
+        pthread_join(clients[i].thread, 0);
+        ok += clients[i].ok;
+        bad += clients[i].bad;
+    }
+    elapsed = ustime()-start;
+    if (pid) proc_io(&r1, &w1);
+
+    printf("conns %d, requests %ld ok, %ld failed, body %d bytes\n", conns, ok, bad, body);
+    printf("%.0f requests/sec\n", ok*1000000.0/(elapsed ? elapsed : 1));
+    if (pid && ok) {
+        printf("server syscalls/request: %.2f read, %.2f write\n",
+               (double)(r1-r0)/ok, (double)(w1-w0)/ok);
+    }
+
+    free(clients);
+    free(request);
+    return 0;
+}
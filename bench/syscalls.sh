@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# syscalls.sh -- compare syscalls per request of level and edge-triggered
+# connection handling.
+#
+# Usage: bench/syscalls.sh [conns] [requests] [body bytes]
+#
+# Run from the build directory after `make && make bench`. Uses strace -c
+# when available, otherwise the read/write counters in /proc/<pid>/io.
+
+CONNS=${1:-8}
+REQUESTS=${2:-5000}
+BODY=${3:-0}
+PORT=${PORT:-18080}
+HTTPD=${HTTPD:-./httpd}
+BENCH=${BENCH:-./bench/httpd_bench}
+
+server_pid() {
+    child=$(cat /proc/$1/task/*/children 2>/dev/null | awk '{ print $1; exit }')
+    echo ${child:-$1}
+}
+
+run() {
+    mode=$1
+    shift
+    echo "== $mode"
+    if command -v strace >/dev/null 2>&1; then
+        strace -c -f -o /tmp/libhttpd-$mode.strace $HTTPD -p $PORT --quiet "$@" &
+    else
+        $HTTPD -p $PORT --quiet "$@" &
+    fi
+    pid=$!
+    sleep 1
+    # the libtool wrapper execs the real binary, so the server is $pid, or
+    # the child strace started.
+    server=$(server_pid $pid)
+    $BENCH -p $PORT -c $CONNS -n $REQUESTS -b $BODY -P $server
+    # strace detaches on a signal, stop the server for it to exit.
+    kill $server
+    wait $pid 2>/dev/null
+    if [ -f /tmp/libhttpd-$mode.strace ]; then
+        grep -E "calls|epoll|read|write|accept" /tmp/libhttpd-$mode.strace
+        rm -f /tmp/libhttpd-$mode.strace
+    fi
+    PORT=$((PORT+1))
+}
+
+run level
+run edge -e
@@ -34,21 +34,30 @@
 
 static char host[128] = "0.0.0.0";
 static int port = 8080;
+static int threads = 1;
+static int dispatch = LIBHTTPD_DISPATCH_REUSEPORT;
 static int debug = 0;
 static int quiet = 0;
+static int edge = 0;
+static int keepalive = 60;
+static char *root = 0;
 
 
 static void
 usage(void) {
     printf("httpd is a simple http server example.\n");
     printf("httpd version %s running on libhttpd %d.%d.%d.\n\n", "0.0.0", 0, 0, 0);
-    printf("Usage: httpd [-h host] [-p port] [-k keepalive]\n");
-    printf("                     [-d] [--quiet]\n");
+    printf("Usage: httpd [-h host] [-p port] [-k keepalive] [-t threads]\n");
+    printf("                     [-a reuseport|roundrobin|leastconn] [-e] [-r root] [-d] [--quiet]\n");
     printf("       httpd --help\n\n");
     printf(" -d : enable debug messages.\n");
     printf(" -h : httpd bind host. Defaults to localhost.\n");
     printf(" -p : httpd bind port. Defaults to 8080.\n");
-    printf(" -k : keep alive in seconds for this client. Defaults to 300.\n");
+    printf(" -k : close connections idle for this many seconds, 0 never. Defaults to 60.\n");
+    printf(" -t : worker threads, 0 for one per cpu. Defaults to 1.\n");
+    printf(" -a : how connections are handed to workers. Defaults to reuseport.\n");
+    printf(" -e : edge-triggered polling, drain sockets until EAGAIN.\n");
+    printf(" -r : serve static files below this directory.\n");
     printf(" --help : display this message.\n");
     printf(" --quiet : don't print error messages.\n");
     printf("\nSee https://github.com/zhoukk/libhttpd for more information.\n\n");
@@ -80,6 +89,55 @@ config(int argc, char *argv[]) {
                 }
             }
             i++;
+        } else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--threads")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: -t argument given but no threads specified.\n\n");
+                goto e;
+            } else {
+                threads = atoi(argv[i+1]);
+                if (threads < 0) {
+                    fprintf(stderr, "Error: Invalid threads given: %d\n", threads);
+                    goto e;
+                }
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-a") || !strcmp(argv[i], "--dispatch")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: -a argument given but no dispatch specified.\n\n");
+                goto e;
+            } else if (!strcmp(argv[i+1], "reuseport")) {
+                dispatch = LIBHTTPD_DISPATCH_REUSEPORT;
+            } else if (!strcmp(argv[i+1], "roundrobin")) {
+                dispatch = LIBHTTPD_DISPATCH_ROUNDROBIN;
+            } else if (!strcmp(argv[i+1], "leastconn")) {
+                dispatch = LIBHTTPD_DISPATCH_LEASTCONN;
+            } else {
+                fprintf(stderr, "Error: Invalid dispatch given: %s\n", argv[i+1]);
+                goto e;
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-k") || !strcmp(argv[i], "--keepalive")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: -k argument given but no keepalive specified.\n\n");
+                goto e;
+            } else {
+                keepalive = atoi(argv[i+1]);
+                if (keepalive < 0) {
+                    fprintf(stderr, "Error: Invalid keepalive given: %d\n", keepalive);
+                    goto e;
+                }
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--root")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: -r argument given but no root specified.\n\n");
+                goto e;
+            } else {
+                root = argv[i+1];
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-e") || !strcmp(argv[i], "--edge")) {
+            edge = 1;
         } else if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--debug")) {
             debug = 1;
         } else if (!strcmp(argv[i], "--help")) {
@@ -105,7 +163,6 @@ httpd_cb(void *ud, struct libhttpd_request *req, struct libhttpd_response *res)
 
     libhttpd_response_header(res, "Content-Type", "text/html");
     libhttpd_response_header(res, "Server", "libhttpd");
-    libhttpd_response_header(res, "Connection", "close");
 
     libhttpd_response_write(res, "hello libhttpd", 14);
     libhttpd_response_end(res, 200);
@@ -121,9 +178,21 @@ main(int argc, char *argv[]) {
 
     config(argc, argv);
 
-    libhttpd__loglevel(LIBHTTPD_LOG_DEBUG);
-
-    libhttpd__serve(host, port, 0, httpd_cb);
+    libhttpd__loglevel(debug ? LIBHTTPD_LOG_DEBUG : LIBHTTPD_LOG_INFO);
+    libhttpd__threads(threads);
+    libhttpd__dispatch(dispatch);
+    libhttpd__nofile(-1);
+    libhttpd__edge(edge);
+    libhttpd__keepalive(keepalive);
+
+    if (root) {
+        struct libhttpd_static *st = libhttpd_static_create("/", root);
+        libhttpd_static_cache(st, 1024, 1000);
+        libhttpd__serve(host, port, st, libhttpd_static_handler);
+        libhttpd_static_destroy(st);
+    } else {
+        libhttpd__serve(host, port, 0, httpd_cb);
+    }
     return 0;
 }
 
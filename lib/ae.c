@@ -45,7 +45,11 @@
 #include "config.h"
 
 /* Include the best multiplexing layer supported by this system.
- * The following should be ordered by performances, descending. */
+ * The following should be ordered by performances, descending.
+ * io_uring is only used when selected at configure time. */
+#ifdef USE_IO_URING
+#include "ae_uring.c"
+#else
 #ifdef HAVE_EVPORT
 #include "ae_evport.c"
 #else
@@ -59,6 +63,10 @@
         #endif
     #endif
 #endif
+#endif
+
+static void aeTimeHeapRemove(aeEventLoop *eventLoop, aeTimeEvent *te);
+static void aeTimeEventFree(aeEventLoop *eventLoop, long long id, aeTimeEvent *te);
 
 aeEventLoop *aeCreateEventLoop(int setsize) {
     aeEventLoop *eventLoop;
@@ -69,12 +77,21 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     eventLoop->fired = zmalloc(sizeof(aeFiredEvent)*setsize);
     if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
     eventLoop->setsize = setsize;
-    eventLoop->lastTime = time(NULL);
-    eventLoop->timeEventHead = NULL;
+    aeUpdateTime(eventLoop);
+    eventLoop->timeEventHeap = NULL;
+    eventLoop->timeEventCount = 0;
+    eventLoop->timeEventHeapSize = 0;
+    eventLoop->timeEventSlots = NULL;
+    eventLoop->timeEventFreeSlots = NULL;
+    eventLoop->timeEventFreeCount = 0;
+    eventLoop->timeEventSlotsSize = 0;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
+    eventLoop->privdata = NULL;
+    eventLoop->flags = 0;
+    eventLoop->ioCount = 0;
     if (aeApiCreate(eventLoop) == -1) goto err;
     /* Events with mask == AE_NONE are not set. So let's initialize the
      * vector with it. */
@@ -122,6 +139,15 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize) {
 }
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    while (eventLoop->timeEventCount > 0) {
+        aeTimeEvent *te = eventLoop->timeEventHeap[0];
+
+        aeTimeHeapRemove(eventLoop, te);
+        aeTimeEventFree(eventLoop, te->id, te);
+    }
+    zfree(eventLoop->timeEventHeap);
+    zfree(eventLoop->timeEventSlots);
+    zfree(eventLoop->timeEventFreeSlots);
     aeApiFree(eventLoop);
     zfree(eventLoop->events);
     zfree(eventLoop->fired);
@@ -158,6 +184,8 @@ void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
     aeFileEvent *fe = &eventLoop->events[fd];
     if (fe->mask == AE_NONE) return;
 
+    /* Once neither direction is watched the edge flag goes too. */
+    if (!(fe->mask & ~mask & (AE_READABLE|AE_WRITABLE))) mask |= AE_EDGE;
     aeApiDelEvent(eventLoop, fd, mask);
     fe->mask = fe->mask & (~mask);
     if (fd == eventLoop->maxfd && fe->mask == AE_NONE) {
@@ -177,59 +205,269 @@ int aeGetFileEvents(aeEventLoop *eventLoop, int fd) {
     return fe->mask;
 }
 
-static void aeGetTime(long *seconds, long *milliseconds)
+/* The loop clock is monotonic, so timers are immune to wall clock steps.
+ * Building with USE_COARSE_CLOCK trades resolution (a few milliseconds)
+ * for a cheaper read where CLOCK_MONOTONIC_COARSE exists. */
+#if defined(USE_COARSE_CLOCK) && defined(CLOCK_MONOTONIC_COARSE)
+#define AE_CLOCK CLOCK_MONOTONIC_COARSE
+#elif defined(CLOCK_MONOTONIC)
+#define AE_CLOCK CLOCK_MONOTONIC
+#endif
+
+static long long aeMonotonicTime(void)
 {
+#ifdef AE_CLOCK
+    struct timespec ts;
+
+    clock_gettime(AE_CLOCK, &ts);
+    return ((long long)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+#else
     struct timeval tv;
 
     gettimeofday(&tv, NULL);
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec/1000;
+    return ((long long)tv.tv_sec)*1000 + tv.tv_usec/1000;
+#endif
+}
+
+/* Sample the loop clock. aeProcessEvents() does it once per pass, right
+ * after polling, so every file and time event handled in that pass (and
+ * every timer they arm) sees the same time without reading the clock. */
+void aeUpdateTime(aeEventLoop *eventLoop) {
+    eventLoop->monotime = aeMonotonicTime();
+}
+
+/* Return the cached loop clock in monotonic milliseconds. */
+long long aeGetMonotonicTime(aeEventLoop *eventLoop) {
+    return eventLoop->monotime;
+}
+
+/* Completion based requests, only backends defining AE_API_IO have them.
+ * Callers check aeIoSupported() and keep to file events otherwise. */
+#ifdef AE_API_IO
+int aeIoSupported(aeEventLoop *eventLoop) {
+    return aeApiIoSupported(eventLoop);
+}
+
+static int aeIoStart(aeEventLoop *eventLoop, aeIo *io, int rc) {
+    if (rc == -1) return AE_ERR;
+    io->active = 1;
+    io->cancel = 0;
+    eventLoop->ioCount++;
+    return AE_OK;
+}
+
+/* Accept connections on io->fd until cancelled, one completion each. */
+int aeIoAccept(aeEventLoop *eventLoop, aeIo *io) {
+    if (io->active) return AE_ERR;
+    return aeIoStart(eventLoop, io, aeApiIoAccept(eventLoop, io));
+}
+
+/* Receive from io->fd until cancelled or out of buffers, one completion
+ * per read. data points into a buffer of the loop, valid during proc. */
+int aeIoRecv(aeEventLoop *eventLoop, aeIo *io) {
+    if (io->active) return AE_ERR;
+    return aeIoStart(eventLoop, io, aeApiIoRecv(eventLoop, io));
+}
+
+/* Send msg on io->fd once. msg, its iovecs and the data must stay valid
+ * until proc is called. */
+int aeIoSendmsg(aeEventLoop *eventLoop, aeIo *io, struct msghdr *msg) {
+    if (io->active) return AE_ERR;
+    return aeIoStart(eventLoop, io, aeApiIoSendmsg(eventLoop, io, msg));
+}
+
+/* Ask for the request to end early. proc still gets its last completion,
+ * -ECANCELED unless it finished first. */
+void aeIoCancel(aeEventLoop *eventLoop, aeIo *io) {
+    if (!io->active || io->cancel) return;
+    if (aeApiIoCancel(eventLoop, io) == 0) io->cancel = 1;
+}
+#else
+int aeIoSupported(aeEventLoop *eventLoop) {
+    AE_NOTUSED(eventLoop);
+    return 0;
+}
+
+int aeIoAccept(aeEventLoop *eventLoop, aeIo *io) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(io);
+    return AE_ERR;
+}
+
+int aeIoRecv(aeEventLoop *eventLoop, aeIo *io) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(io);
+    return AE_ERR;
+}
+
+int aeIoSendmsg(aeEventLoop *eventLoop, aeIo *io, struct msghdr *msg) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(io);
+    AE_NOTUSED(msg);
+    return AE_ERR;
+}
+
+void aeIoCancel(aeEventLoop *eventLoop, aeIo *io) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(io);
+}
+#endif
+
+/* Time events are kept in a binary min-heap ordered by expire time, so the
+ * nearest timer is always the root and arming or firing a timer costs
+ * O(log(N)). Ids map back to their event through a slot table: the low 32
+ * bits of an id are the slot, the high bits a wrapping sequence number that
+ * tells a stale id apart from a newer event reusing the same slot. This
+ * makes aeDeleteTimeEvent() O(log(N)) instead of a list walk. */
+#define AE_TIME_SLOT(id) ((int)((id) & 0xffffffffLL))
+
+/* Timers due at the same time fire in the order they were armed. */
+static int aeTimeEventBefore(aeTimeEvent *a, aeTimeEvent *b) {
+    return a->when < b->when || (a->when == b->when && a->seq < b->seq);
+}
+
+static void aeTimeHeapSet(aeEventLoop *eventLoop, int i, aeTimeEvent *te) {
+    eventLoop->timeEventHeap[i] = te;
+    te->index = i;
 }
 
-static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms) {
-    long cur_sec, cur_ms, when_sec, when_ms;
+static void aeTimeHeapUp(aeEventLoop *eventLoop, int i) {
+    aeTimeEvent *te = eventLoop->timeEventHeap[i];
+
+    while (i > 0) {
+        int parent = (i-1)/2;
+        if (!aeTimeEventBefore(te, eventLoop->timeEventHeap[parent])) break;
+        aeTimeHeapSet(eventLoop, i, eventLoop->timeEventHeap[parent]);
+        i = parent;
+    }
+    aeTimeHeapSet(eventLoop, i, te);
+}
 
-    aeGetTime(&cur_sec, &cur_ms);
-    when_sec = cur_sec + milliseconds/1000;
-    when_ms = cur_ms + milliseconds%1000;
-    if (when_ms >= 1000) {
-        when_sec ++;
-        when_ms -= 1000;
+static void aeTimeHeapDown(aeEventLoop *eventLoop, int i) {
+    aeTimeEvent *te = eventLoop->timeEventHeap[i];
+    int n = eventLoop->timeEventCount;
+
+    while (1) {
+        int child = 2*i+1;
+        if (child >= n) break;
+        if (child+1 < n && aeTimeEventBefore(eventLoop->timeEventHeap[child+1],
+                                             eventLoop->timeEventHeap[child]))
+            child++;
+        if (!aeTimeEventBefore(eventLoop->timeEventHeap[child], te)) break;
+        aeTimeHeapSet(eventLoop, i, eventLoop->timeEventHeap[child]);
+        i = child;
     }
-    *sec = when_sec;
-    *ms = when_ms;
+    aeTimeHeapSet(eventLoop, i, te);
+}
+
+static int aeTimeHeapInsert(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (eventLoop->timeEventCount == eventLoop->timeEventHeapSize) {
+        int size = eventLoop->timeEventHeapSize ? eventLoop->timeEventHeapSize*2 : 64;
+        aeTimeEvent **heap = zrealloc(eventLoop->timeEventHeap, sizeof(aeTimeEvent*)*size);
+
+        if (heap == NULL) return AE_ERR;
+        eventLoop->timeEventHeap = heap;
+        eventLoop->timeEventHeapSize = size;
+    }
+    aeTimeHeapSet(eventLoop, eventLoop->timeEventCount++, te);
+    aeTimeHeapUp(eventLoop, te->index);
+    return AE_OK;
+}
+
+static void aeTimeHeapRemove(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    int i = te->index;
+    aeTimeEvent *last = eventLoop->timeEventHeap[--eventLoop->timeEventCount];
+
+    te->index = -1;
+    if (last == te) return;
+    aeTimeHeapSet(eventLoop, i, last);
+    if (i > 0 && aeTimeEventBefore(last, eventLoop->timeEventHeap[(i-1)/2]))
+        aeTimeHeapUp(eventLoop, i);
+    else
+        aeTimeHeapDown(eventLoop, i);
+}
+
+static int aeTimeSlotAlloc(aeEventLoop *eventLoop) {
+    int slot, i, size;
+
+    if (eventLoop->timeEventFreeCount > 0)
+        return eventLoop->timeEventFreeSlots[--eventLoop->timeEventFreeCount];
+
+    size = eventLoop->timeEventSlotsSize ? eventLoop->timeEventSlotsSize*2 : 64;
+    aeTimeEvent **slots = zrealloc(eventLoop->timeEventSlots, sizeof(aeTimeEvent*)*size);
+    if (slots == NULL) return -1;
+    eventLoop->timeEventSlots = slots;
+    int *freeSlots = zrealloc(eventLoop->timeEventFreeSlots, sizeof(int)*size);
+    if (freeSlots == NULL) return -1;
+    eventLoop->timeEventFreeSlots = freeSlots;
+
+    /* Hand out the lowest new slot now, queue the rest highest first. */
+    slot = eventLoop->timeEventSlotsSize;
+    for (i = size-1; i > slot; i--) {
+        eventLoop->timeEventSlots[i] = NULL;
+        eventLoop->timeEventFreeSlots[eventLoop->timeEventFreeCount++] = i;
+    }
+    eventLoop->timeEventSlotsSize = size;
+    return slot;
+}
+
+static void aeTimeEventFree(aeEventLoop *eventLoop, long long id, aeTimeEvent *te) {
+    int slot = AE_TIME_SLOT(id);
+
+    eventLoop->timeEventSlots[slot] = NULL;
+    eventLoop->timeEventFreeSlots[eventLoop->timeEventFreeCount++] = slot;
+    if (te->finalizerProc)
+        te->finalizerProc(eventLoop, te->clientData);
+    zfree(te);
 }
 
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc)
 {
-    long long id = eventLoop->timeEventNextId++;
+    long long seq = eventLoop->timeEventNextId++;
     aeTimeEvent *te;
+    int slot;
 
     te = zmalloc(sizeof(*te));
     if (te == NULL) return AE_ERR;
-    te->id = id;
-    aeAddMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
+    if ((slot = aeTimeSlotAlloc(eventLoop)) == -1) {
+        zfree(te);
+        return AE_ERR;
+    }
+    te->id = ((seq & 0x7fffffffLL) << 32) | slot;
+    te->seq = seq;
+    te->when = eventLoop->monotime + milliseconds;
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->next = eventLoop->timeEventHead;
-    eventLoop->timeEventHead = te;
-    return id;
+    if (aeTimeHeapInsert(eventLoop, te) == AE_ERR) {
+        eventLoop->timeEventFreeSlots[eventLoop->timeEventFreeCount++] = slot;
+        zfree(te);
+        return AE_ERR;
+    }
+    eventLoop->timeEventSlots[slot] = te;
+    return te->id;
 }
 
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    while(te) {
-        if (te->id == id) {
-            te->id = AE_DELETED_EVENT_ID;
-            return AE_OK;
-        }
-        te = te->next;
+    int slot = AE_TIME_SLOT(id);
+    aeTimeEvent *te;
+
+    if (id < 0 || slot >= eventLoop->timeEventSlotsSize) return AE_ERR;
+    te = eventLoop->timeEventSlots[slot];
+    if (te == NULL || te->id != id) return AE_ERR; /* NO event with the specified ID found */
+
+    /* An event deleted from its own callback is not in the heap anymore,
+     * processTimeEvents() frees it once the callback returns. */
+    if (te->index == -1) {
+        te->id = AE_DELETED_EVENT_ID;
+        return AE_OK;
     }
-    return AE_ERR; /* NO event with the specified ID found */
+    aeTimeHeapRemove(eventLoop, te);
+    aeTimeEventFree(eventLoop, id, te);
+    return AE_OK;
 }
 
 /* Search the first timer to fire.
@@ -237,98 +475,41 @@ int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
  * put in sleep without to delay any event.
  * If there are no timers NULL is returned.
  *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
- */
+ * The nearest timer is the root of the heap, so this is O(1). */
 static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
-
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
-    }
-    return nearest;
+    return eventLoop->timeEventCount ? eventLoop->timeEventHeap[0] : NULL;
 }
 
 /* Process time events */
 static int processTimeEvents(aeEventLoop *eventLoop) {
     int processed = 0;
-    aeTimeEvent *te, *prev;
-    long long maxId;
-    time_t now = time(NULL);
-
-    /* If the system clock is moved to the future, and then set back to the
-     * right value, time events may be delayed in a random way. Often this
-     * means that scheduled operations will not be performed soon enough.
-     *
-     * Here we try to detect system clock skews, and force all the time
-     * events to be processed ASAP when this happens: the idea is that
-     * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
-    if (now < eventLoop->lastTime) {
-        te = eventLoop->timeEventHead;
-        while(te) {
-            te->when_sec = 0;
-            te = te->next;
-        }
-    }
-    eventLoop->lastTime = now;
+    aeTimeEvent *te;
+    long long maxSeq;
 
-    prev = NULL;
-    te = eventLoop->timeEventHead;
-    maxId = eventLoop->timeEventNextId-1;
-    while(te) {
-        long now_sec, now_ms;
+    maxSeq = eventLoop->timeEventNextId-1;
+    while ((te = aeSearchNearestTimer(eventLoop)) != NULL) {
         long long id;
+        int retval;
 
-        /* Remove events scheduled for deletion. */
-        if (te->id == AE_DELETED_EVENT_ID) {
-            aeTimeEvent *next = te->next;
-            if (prev == NULL)
-                eventLoop->timeEventHead = te->next;
-            else
-                prev->next = te->next;
-            if (te->finalizerProc)
-                te->finalizerProc(eventLoop, te->clientData);
-            zfree(te);
-            te = next;
-            continue;
-        }
+        if (eventLoop->monotime < te->when) break;
 
         /* Make sure we don't process time events created by time events in
-         * this iteration. Note that this check is currently useless: we always
-         * add new timers on the head, however if we change the implementation
-         * detail, this check may be useful again: we keep it here for future
-         * defense. */
-        if (te->id > maxId) {
-            te = te->next;
-            continue;
-        }
-        aeGetTime(&now_sec, &now_ms);
-        if (now_sec > te->when_sec ||
-            (now_sec == te->when_sec && now_ms >= te->when_ms))
-        {
-            int retval;
-
-            id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
-            processed++;
-            if (retval != AE_NOMORE) {
-                aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-            } else {
-                te->id = AE_DELETED_EVENT_ID;
-            }
+         * this iteration, they are due in the next one at the earliest. */
+        if (te->seq > maxSeq) break;
+
+        id = te->id;
+        aeTimeHeapRemove(eventLoop, te);
+        retval = te->timeProc(eventLoop, id, te->clientData);
+        processed++;
+        if (retval != AE_NOMORE && te->id != AE_DELETED_EVENT_ID) {
+            /* a re-armed timer counts as armed in this pass, so one that
+             * asks to run again at once waits for the next pass. */
+            te->when = eventLoop->monotime + retval;
+            te->seq = eventLoop->timeEventNextId++;
+            if (aeTimeHeapInsert(eventLoop, te) == AE_OK) continue;
         }
-        prev = te;
-        te = te->next;
+        aeTimeEventFree(eventLoop, id, te);
     }
     return processed;
 }
@@ -357,7 +538,7 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
      * file events to process as long as we want to process time
      * events, in order to sleep until the next time event is ready
      * to fire. */
-    if (eventLoop->maxfd != -1 ||
+    if (eventLoop->maxfd != -1 || eventLoop->ioCount ||
         ((flags & AE_TIME_EVENTS) && !(flags & AE_DONT_WAIT))) {
         int j;
         aeTimeEvent *shortest = NULL;
@@ -366,16 +547,12 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
         if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
             shortest = aeSearchNearestTimer(eventLoop);
         if (shortest) {
-            long now_sec, now_ms;
-
-            aeGetTime(&now_sec, &now_ms);
             tvp = &tv;
 
             /* How many milliseconds we need to wait for the next
-             * time event to fire? */
-            long long ms =
-                (shortest->when_sec - now_sec)*1000 +
-                shortest->when_ms - now_ms;
+             * time event to fire? The cached clock is at most one pass
+             * old, which can only delay the timer by that pass. */
+            long long ms = shortest->when - eventLoop->monotime;
 
             if (ms > 0) {
                 tvp->tv_sec = ms/1000;
@@ -398,6 +575,11 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
         }
 
         numevents = aeApiPoll(eventLoop, tvp);
+        aeUpdateTime(eventLoop);
+#ifdef AE_API_IO
+        /* completions reaped by the poll, ahead of readiness events. */
+        processed += aeApiIoComplete(eventLoop);
+#endif
         for (j = 0; j < numevents; j++) {
             aeFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
             int mask = eventLoop->fired[j].mask;
@@ -410,6 +592,8 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
             if (fe->mask & mask & AE_READABLE) {
                 rfired = 1;
                 fe->rfileProc(eventLoop,fd,fe->clientData,mask);
+                /* the proc may have grown the set, moving events[]. */
+                fe = &eventLoop->events[fd];
             }
             if (fe->mask & mask & AE_WRITABLE) {
                 if (!rfired || fe->wfileProc != fe->rfileProc)
@@ -417,6 +601,8 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
             }
             processed++;
         }
+    } else {
+        aeUpdateTime(eventLoop);
     }
     /* Check time events */
     if (flags & AE_TIME_EVENTS)
@@ -452,7 +638,7 @@ void aeMain(aeEventLoop *eventLoop) {
     while (!eventLoop->stop) {
         if (eventLoop->beforesleep != NULL)
             eventLoop->beforesleep(eventLoop);
-        aeProcessEvents(eventLoop, AE_ALL_EVENTS);
+        aeProcessEvents(eventLoop, AE_ALL_EVENTS|(eventLoop->flags & AE_DONT_WAIT));
     }
 }
 
@@ -463,3 +649,12 @@ char *aeGetApiName(void) {
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep) {
     eventLoop->beforesleep = beforesleep;
 }
+
+/* Make aeMain() poll without blocking, for owners that still have work
+ * queued from the last pass (for example sockets left undrained). */
+void aeSetDontWait(aeEventLoop *eventLoop, int noWait) {
+    if (noWait)
+        eventLoop->flags |= AE_DONT_WAIT;
+    else
+        eventLoop->flags &= ~AE_DONT_WAIT;
+}
@@ -41,6 +41,8 @@
 #define AE_NONE 0
 #define AE_READABLE 1
 #define AE_WRITABLE 2
+#define AE_EDGE 4 /* edge-triggered where the backend supports it (epoll),
+                     handlers must then drain the fd until EAGAIN. */
 
 #define AE_FILE_EVENTS 1
 #define AE_TIME_EVENTS 2
@@ -50,16 +52,21 @@
 #define AE_NOMORE -1
 #define AE_DELETED_EVENT_ID -1
 
+#define AE_IO_MORE 1 /* more completions follow for the same request */
+
 /* Macros */
 #define AE_NOTUSED(V) ((void) V)
 
 struct aeEventLoop;
+struct aeIo;
+struct msghdr;
 
 /* Types and data structures */
 typedef void aeFileProc(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask);
 typedef int aeTimeProc(struct aeEventLoop *eventLoop, long long id, void *clientData);
 typedef void aeEventFinalizerProc(struct aeEventLoop *eventLoop, void *clientData);
 typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
+typedef void aeIoProc(struct aeEventLoop *eventLoop, struct aeIo *io, int res, char *data, int flags);
 
 /* File event structure */
 typedef struct aeFileEvent {
@@ -72,14 +79,27 @@ typedef struct aeFileEvent {
 /* Time event structure */
 typedef struct aeTimeEvent {
     long long id; /* time event identifier. */
-    long when_sec; /* seconds */
-    long when_ms; /* milliseconds */
+    long long seq; /* arming order, used to skip timers armed while firing */
+    long long when; /* monotonic milliseconds */
     aeTimeProc *timeProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct aeTimeEvent *next;
+    int index; /* position in the timer heap, -1 while firing */
 } aeTimeEvent;
 
+/* A completion based request, where the backend supports them (io_uring).
+ * The kernel does the accept, recv or send and proc gets its result: the
+ * accepted fd or the bytes moved, 0 at end of stream, or -errno. Owned by
+ * the caller, it carries one request at a time and must stay allocated
+ * while active. */
+typedef struct aeIo {
+    int fd;
+    int active; /* set until proc gets the last completion of the request */
+    int cancel; /* cancellation requested */
+    aeIoProc *proc;
+    void *clientData;
+} aeIo;
+
 /* A fired event */
 typedef struct aeFiredEvent {
     int fd;
@@ -91,13 +111,22 @@ typedef struct aeEventLoop {
     int maxfd;   /* highest file descriptor currently registered */
     int setsize; /* max number of file descriptors tracked */
     long long timeEventNextId;
-    time_t lastTime;     /* Used to detect system clock skew */
+    long long monotime;  /* monotonic ms, sampled once per aeProcessEvents() */
     aeFileEvent *events; /* Registered events */
     aeFiredEvent *fired; /* Fired events */
-    aeTimeEvent *timeEventHead;
+    aeTimeEvent **timeEventHeap; /* binary min-heap ordered by expire time */
+    int timeEventCount;
+    int timeEventHeapSize;
+    aeTimeEvent **timeEventSlots; /* id -> event lookup for O(1) cancel */
+    int *timeEventFreeSlots;
+    int timeEventFreeCount;
+    int timeEventSlotsSize;
     int stop;
     void *apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *beforesleep;
+    void *privdata; /* owner data, e.g. for the beforesleep proc */
+    int flags; /* AE_DONT_WAIT when aeMain() must not block */
+    int ioCount; /* active completion based requests */
 } aeEventLoop;
 
 /* Prototypes */
@@ -119,5 +148,13 @@ char *aeGetApiName(void);
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
 int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
+void aeSetDontWait(aeEventLoop *eventLoop, int noWait);
+long long aeGetMonotonicTime(aeEventLoop *eventLoop);
+void aeUpdateTime(aeEventLoop *eventLoop);
+int aeIoSupported(aeEventLoop *eventLoop);
+int aeIoAccept(aeEventLoop *eventLoop, aeIo *io);
+int aeIoRecv(aeEventLoop *eventLoop, aeIo *io);
+int aeIoSendmsg(aeEventLoop *eventLoop, aeIo *io, struct msghdr *msg);
+void aeIoCancel(aeEventLoop *eventLoop, aeIo *io);
 
 #endif
@@ -0,0 +1,598 @@
+/* Linux io_uring based ae.c module
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Readiness notification through io_uring poll requests, plus completion
+ * based requests (aeIo) for owners that let the kernel do the I/O.
+ *
+ * File events keep the ae contract as is: handlers are told an fd is ready
+ * and do their own reads, writes and accepts. Registering, changing and
+ * removing interest only queues submission entries, they reach the kernel
+ * together with the wait in a single io_uring_enter(2) per loop pass, so
+ * there is no epoll_ctl(2) style syscall per change.
+ *
+ * Polls are one-shot and re-armed from the submission queue after they
+ * fire. A one-shot poll completes at once if the fd is still ready when it
+ * is armed, which keeps the level-triggered semantics the ae handlers rely
+ * on. Fds registered with AE_EDGE get a multishot poll instead, which only
+ * fires on new wakeups and stays armed, matching EPOLLET.
+ *
+ * The user_data of every poll carries the fd in the low 32 bits and a per
+ * fd generation in the high bits, completions of polls that were replaced
+ * or removed meanwhile are recognised and dropped. Poll removals and
+ * cancellations carry AE_URING_REMOVE instead, their completions are
+ * skipped.
+ *
+ * Completion based requests are a multishot accept, a multishot recv
+ * picking buffers from a ring the loop provides to the kernel, and a
+ * sendmsg. They are queued like polls, so accepting, reading and writing
+ * cost no syscall of their own. Their user_data is the aeIo with
+ * AE_URING_IO set, their completions are queued by aeApiPoll and handed to
+ * the owners once the loop clock was updated. A recv buffer goes back to
+ * the ring once its proc returned.
+ *
+ * Needs Linux 5.11 or later (IORING_FEAT_EXT_ARG, for the wait timeout).
+ * Completion based requests need Linux 6.0 (multishot recv), without it
+ * aeIoSupported() is 0 and owners keep to file events. */
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <poll.h>
+
+#define AE_URING_ENTRIES 4096
+#define AE_URING_REMOVE 0xffffffffffffffffULL
+#define AE_URING_IO (1ULL << 63)
+#define AE_URING_GEN_MASK 0x7fffffffU
+
+/* provided buffers for multishot recv, 4MB of address space per loop whose
+ * pages are only touched once used. */
+#define AE_URING_BGID 0
+#define AE_URING_BUFS 1024
+#define AE_URING_BUF_LEN 4096
+
+#define AE_API_IO
+
+/* a completion reaped by aeApiPoll, handed over by aeApiIoComplete. */
+typedef struct aeUringDone {
+    aeIo *io;
+    int res;
+    unsigned flags;
+} aeUringDone;
+
+typedef struct aeApiState {
+    int ringfd;
+
+    /* submission queue */
+    unsigned *sqhead;
+    unsigned *sqtail;
+    unsigned sqmask;
+    unsigned sqentries;
+    struct io_uring_sqe *sqes;
+    unsigned sqpending;
+
+    /* completion queue */
+    unsigned *cqhead;
+    unsigned *cqtail;
+    unsigned cqmask;
+    struct io_uring_cqe *cqes;
+
+    void *sqring;
+    size_t sqringsize;
+    void *cqring;
+    size_t cqringsize;
+    size_t sqessize;
+
+    /* per fd bookkeeping, indexed by fd */
+    unsigned *gen;      /* generation of the poll currently armed */
+    unsigned char *want; /* AE mask the loop wants to watch */
+    unsigned char *armed; /* AE mask of the poll armed in the kernel */
+    unsigned char *dirty; /* fd is queued in the dirty list */
+    int *dirtylist;      /* fds whose poll must be (re)armed or removed */
+    int ndirty;
+
+    /* completion based requests, io is 0 when the kernel lacks them */
+    int io;
+    struct io_uring_buf_ring *bufring;
+    size_t bufringsize;
+    char *bufs;
+    aeUringDone *done;
+    int ndone;
+    int donesize;
+} aeApiState;
+
+static int aeUringSetup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int aeUringEnter(int fd, unsigned submit, unsigned wait, unsigned flags,
+        void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int aeUringRegister(int fd, unsigned opcode, void *arg, unsigned nargs) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+static void aeUringUnmap(aeApiState *state) {
+    if (state->sqes) munmap(state->sqes, state->sqessize);
+    if (state->cqring && state->cqring != state->sqring)
+        munmap(state->cqring, state->cqringsize);
+    if (state->sqring) munmap(state->sqring, state->sqringsize);
+    if (state->bufring) munmap(state->bufring, state->bufringsize);
+    if (state->bufs) munmap(state->bufs, (size_t)AE_URING_BUFS*AE_URING_BUF_LEN);
+    zfree(state->done);
+}
+
+/* Hand buffer bid back to the kernel. */
+static void aeUringBufPut(aeApiState *state, unsigned short bid) {
+    unsigned short tail = state->bufring->tail;
+    struct io_uring_buf *buf = &state->bufring->bufs[tail & (AE_URING_BUFS-1)];
+
+    buf->addr = (unsigned long long)(uintptr_t)(state->bufs + (size_t)bid*AE_URING_BUF_LEN);
+    buf->len = AE_URING_BUF_LEN;
+    buf->bid = bid;
+    __atomic_store_n(&state->bufring->tail, tail+1, __ATOMIC_RELEASE);
+}
+
+/* Set up completion based requests if the kernel has them: multishot recv
+ * came in 6.0 along with IORING_OP_SEND_ZC, which the probe can see. The
+ * loop keeps to polls when this fails. */
+static void aeUringIoSetup(aeApiState *state, unsigned cqentries) {
+    struct io_uring_probe *probe;
+    struct io_uring_buf_reg reg;
+    size_t probesize = sizeof(*probe) + 256*sizeof(struct io_uring_probe_op);
+    int ok;
+    unsigned i;
+
+    probe = zmalloc(probesize);
+    memset(probe, 0, probesize);
+    ok = aeUringRegister(state->ringfd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+        probe->last_op >= IORING_OP_SEND_ZC &&
+        (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+    zfree(probe);
+    if (!ok) return;
+
+    state->bufringsize = AE_URING_BUFS*sizeof(struct io_uring_buf);
+    state->bufring = mmap(NULL, state->bufringsize, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    state->bufs = mmap(NULL, (size_t)AE_URING_BUFS*AE_URING_BUF_LEN, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (state->bufring == MAP_FAILED || state->bufs == MAP_FAILED) goto err;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)state->bufring;
+    reg.ring_entries = AE_URING_BUFS;
+    reg.bgid = AE_URING_BGID;
+    if (aeUringRegister(state->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) goto err;
+    state->bufring->tail = 0;
+    for (i = 0; i < AE_URING_BUFS; i++) aeUringBufPut(state, i);
+
+    state->donesize = cqentries;
+    state->done = zmalloc(sizeof(aeUringDone)*cqentries);
+    state->io = 1;
+    return;
+
+err:
+    if (state->bufring != MAP_FAILED) munmap(state->bufring, state->bufringsize);
+    if (state->bufs != MAP_FAILED) munmap(state->bufs, (size_t)AE_URING_BUFS*AE_URING_BUF_LEN);
+    state->bufring = NULL;
+    state->bufs = NULL;
+}
+
+static int aeApiAllocFds(aeApiState *state, int setsize) {
+    state->gen = zrealloc(state->gen, sizeof(unsigned)*setsize);
+    state->want = zrealloc(state->want, setsize);
+    state->armed = zrealloc(state->armed, setsize);
+    state->dirty = zrealloc(state->dirty, setsize);
+    state->dirtylist = zrealloc(state->dirtylist, sizeof(int)*setsize);
+    return 0;
+}
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    aeApiState *state = zmalloc(sizeof(aeApiState));
+    struct io_uring_params p;
+    unsigned *array, i;
+
+    if (!state) return -1;
+    memset(state, 0, sizeof(*state));
+    memset(&p, 0, sizeof(p));
+    state->ringfd = aeUringSetup(AE_URING_ENTRIES, &p);
+    if (state->ringfd == -1) {
+        zfree(state);
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG)) goto err;
+
+    state->sqringsize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    state->cqringsize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cqringsize > state->sqringsize)
+            state->sqringsize = state->cqringsize;
+        state->cqringsize = state->sqringsize;
+    }
+    state->sqring = mmap(NULL, state->sqringsize, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_SQ_RING);
+    if (state->sqring == MAP_FAILED) {
+        state->sqring = NULL;
+        goto err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        state->cqring = state->sqring;
+    } else {
+        state->cqring = mmap(NULL, state->cqringsize, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_CQ_RING);
+        if (state->cqring == MAP_FAILED) {
+            state->cqring = NULL;
+            goto err;
+        }
+    }
+    state->sqessize = p.sq_entries*sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL, state->sqessize, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        goto err;
+    }
+
+    state->sqhead = (unsigned *)((char *)state->sqring + p.sq_off.head);
+    state->sqtail = (unsigned *)((char *)state->sqring + p.sq_off.tail);
+    state->sqmask = *(unsigned *)((char *)state->sqring + p.sq_off.ring_mask);
+    state->sqentries = p.sq_entries;
+    array = (unsigned *)((char *)state->sqring + p.sq_off.array);
+    for (i = 0; i < p.sq_entries; i++) array[i] = i;
+
+    state->cqhead = (unsigned *)((char *)state->cqring + p.cq_off.head);
+    state->cqtail = (unsigned *)((char *)state->cqring + p.cq_off.tail);
+    state->cqmask = *(unsigned *)((char *)state->cqring + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe *)((char *)state->cqring + p.cq_off.cqes);
+
+    aeUringIoSetup(state, p.cq_entries);
+
+    aeApiAllocFds(state, eventLoop->setsize);
+    memset(state->gen, 0, sizeof(unsigned)*eventLoop->setsize);
+    memset(state->want, 0, eventLoop->setsize);
+    memset(state->armed, 0, eventLoop->setsize);
+    memset(state->dirty, 0, eventLoop->setsize);
+    eventLoop->apidata = state;
+    return 0;
+
+err:
+    close(state->ringfd);
+    aeUringUnmap(state);
+    zfree(state);
+    return -1;
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+    int old = eventLoop->setsize;
+
+    aeApiAllocFds(state, setsize);
+    if (setsize > old) {
+        memset(state->gen+old, 0, sizeof(unsigned)*(setsize-old));
+        memset(state->want+old, 0, setsize-old);
+        memset(state->armed+old, 0, setsize-old);
+        memset(state->dirty+old, 0, setsize-old);
+    }
+    return 0;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    close(state->ringfd);
+    aeUringUnmap(state);
+    zfree(state->gen);
+    zfree(state->want);
+    zfree(state->armed);
+    zfree(state->dirty);
+    zfree(state->dirtylist);
+    zfree(state);
+}
+
+/* Hand the queued entries to the kernel without waiting, used when the
+ * submission queue is full. */
+static void aeUringFlush(aeApiState *state) {
+    int n;
+
+    while (state->sqpending) {
+        n = aeUringEnter(state->ringfd, state->sqpending, 0, 0, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        state->sqpending -= n;
+    }
+}
+
+static struct io_uring_sqe *aeUringGetSqe(aeApiState *state) {
+    unsigned tail = *state->sqtail;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(state->sqhead, __ATOMIC_ACQUIRE) >= state->sqentries) {
+        aeUringFlush(state);
+        if (tail - __atomic_load_n(state->sqhead, __ATOMIC_ACQUIRE) >= state->sqentries)
+            return NULL;
+    }
+    sqe = &state->sqes[tail & state->sqmask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(state->sqtail, tail+1, __ATOMIC_RELEASE);
+    state->sqpending++;
+    return sqe;
+}
+
+static unsigned long long aeUringUserData(aeApiState *state, int fd) {
+    return ((unsigned long long)(state->gen[fd] & AE_URING_GEN_MASK) << 32) | (unsigned)fd;
+}
+
+static void aeUringMarkDirty(aeApiState *state, int fd) {
+    if (state->dirty[fd]) return;
+    state->dirty[fd] = 1;
+    state->dirtylist[state->ndirty++] = fd;
+}
+
+/* Cancel the poll armed for fd. A new generation makes any completion of
+ * the old poll stale. */
+static int aeUringDisarm(aeApiState *state, int fd) {
+    struct io_uring_sqe *sqe;
+
+    if (state->armed[fd] != AE_NONE) {
+        if ((sqe = aeUringGetSqe(state)) == NULL) return -1;
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = aeUringUserData(state, fd);
+        sqe->user_data = AE_URING_REMOVE;
+        state->armed[fd] = AE_NONE;
+    }
+    state->gen[fd]++;
+    return 0;
+}
+
+/* Bring the kernel side in line with what the loop wants for fd. */
+static void aeUringSync(aeApiState *state, int fd) {
+    struct io_uring_sqe *sqe;
+    unsigned events = 0;
+
+    state->dirty[fd] = 0;
+    if (state->armed[fd] == state->want[fd]) return;
+    if (aeUringDisarm(state, fd) == -1) goto retry;
+    if (state->want[fd] == AE_NONE) return;
+
+    if ((sqe = aeUringGetSqe(state)) == NULL) goto retry;
+    if (state->want[fd] & AE_READABLE) events |= POLLIN;
+    if (state->want[fd] & AE_WRITABLE) events |= POLLOUT;
+#if BYTE_ORDER == BIG_ENDIAN
+    events = (events << 16) | (events >> 16);
+#endif
+    sqe->opcode = IORING_OP_POLL_ADD;
+    if (state->want[fd] & AE_EDGE) sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = aeUringUserData(state, fd);
+    state->armed[fd] = state->want[fd];
+    return;
+
+retry:
+    aeUringMarkDirty(state, fd);
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+
+    state->want[fd] = (eventLoop->events[fd].mask | mask) & (AE_READABLE|AE_WRITABLE|AE_EDGE);
+    aeUringMarkDirty(state, fd);
+    return 0;
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+
+    state->want[fd] = eventLoop->events[fd].mask & (~delmask) & (AE_READABLE|AE_WRITABLE|AE_EDGE);
+    if (!(state->want[fd] & (AE_READABLE|AE_WRITABLE))) state->want[fd] = AE_NONE;
+    /* The fd is usually closed next and its number may be reused before the
+     * dirty list is synced, so queue the removal ahead of any new poll. */
+    if (state->want[fd] == AE_NONE && aeUringDisarm(state, fd) == 0) return;
+    aeUringMarkDirty(state, fd);
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned head, tail, flags = IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG;
+    int i, ndirty, numevents = 0, wait = 1;
+
+    /* Queue every pending (re)arm and removal, then submit them together
+     * with the wait. Entries failing to fit stay dirty for the next pass,
+     * they are re-queued at or before the slot being processed. */
+    ndirty = state->ndirty;
+    state->ndirty = 0;
+    for (i = 0; i < ndirty; i++)
+        aeUringSync(state, state->dirtylist[i]);
+
+    memset(&arg, 0, sizeof(arg));
+    if (tvp) {
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec*1000;
+        arg.ts = (unsigned long long)(uintptr_t)&ts;
+        if (tvp->tv_sec == 0 && tvp->tv_usec == 0) wait = 0;
+    }
+    head = *state->cqhead;
+    tail = __atomic_load_n(state->cqtail, __ATOMIC_ACQUIRE);
+    if (head != tail) wait = 0;
+
+    while (wait || state->sqpending) {
+        int n = aeUringEnter(state->ringfd, state->sqpending, wait, flags,
+                &arg, sizeof(arg));
+        if (n >= 0) {
+            state->sqpending -= n;
+            break;
+        }
+        if (errno == ETIME || errno == EINTR) break;
+        if (errno == EBUSY || errno == EAGAIN) {
+            /* Completion queue is backed up, reap before submitting. */
+            break;
+        }
+        return 0;
+    }
+
+    tail = __atomic_load_n(state->cqtail, __ATOMIC_ACQUIRE);
+    while (head != tail && numevents < eventLoop->setsize) {
+        struct io_uring_cqe *cqe = &state->cqes[head & state->cqmask];
+        int fd = (int)(cqe->user_data & 0xffffffff);
+        unsigned gen = (unsigned)(cqe->user_data >> 32);
+        int mask = 0;
+
+        if (cqe->user_data == AE_URING_REMOVE) {
+            head++;
+            continue;
+        }
+        if (cqe->user_data & AE_URING_IO) {
+            aeUringDone *done;
+
+            /* The rest waits for the next pass. */
+            if (state->ndone == state->donesize) break;
+            done = &state->done[state->ndone++];
+            done->io = (aeIo *)(uintptr_t)(cqe->user_data & ~AE_URING_IO);
+            done->res = cqe->res;
+            done->flags = cqe->flags;
+            head++;
+            continue;
+        }
+        head++;
+        /* Polls replaced or removed since are stale. */
+        if (fd < 0 || fd >= eventLoop->setsize || gen != (state->gen[fd] & AE_URING_GEN_MASK) ||
+            state->armed[fd] == AE_NONE)
+            continue;
+        /* A multishot poll stays armed for as long as the kernel says so. */
+        if (!(state->armed[fd] & AE_EDGE) || !(cqe->flags & IORING_CQE_F_MORE)) {
+            state->armed[fd] = AE_NONE;
+            aeUringMarkDirty(state, fd);
+        }
+        if (cqe->res < 0) continue;
+
+        if (cqe->res & POLLIN) mask |= AE_READABLE;
+        if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+        if (cqe->res & POLLERR) mask |= AE_WRITABLE;
+        if (cqe->res & POLLHUP) mask |= AE_WRITABLE;
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    __atomic_store_n(state->cqhead, head, __ATOMIC_RELEASE);
+    return numevents;
+}
+
+static int aeApiIoSupported(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    return state->io;
+}
+
+static struct io_uring_sqe *aeUringIoSqe(aeApiState *state, aeIo *io, int opcode) {
+    struct io_uring_sqe *sqe;
+
+    if (!state->io || (sqe = aeUringGetSqe(state)) == NULL) return NULL;
+    sqe->opcode = opcode;
+    sqe->fd = io->fd;
+    sqe->user_data = (unsigned long long)(uintptr_t)io | AE_URING_IO;
+    return sqe;
+}
+
+static int aeApiIoAccept(aeEventLoop *eventLoop, aeIo *io) {
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = aeUringIoSqe(eventLoop->apidata, io, IORING_OP_ACCEPT)) == NULL) return -1;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    return 0;
+}
+
+static int aeApiIoRecv(aeEventLoop *eventLoop, aeIo *io) {
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = aeUringIoSqe(eventLoop->apidata, io, IORING_OP_RECV)) == NULL) return -1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = AE_URING_BGID;
+    return 0;
+}
+
+static int aeApiIoSendmsg(aeEventLoop *eventLoop, aeIo *io, struct msghdr *msg) {
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = aeUringIoSqe(eventLoop->apidata, io, IORING_OP_SENDMSG)) == NULL) return -1;
+    sqe->addr = (unsigned long long)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    return 0;
+}
+
+static int aeApiIoCancel(aeEventLoop *eventLoop, aeIo *io) {
+    aeApiState *state = eventLoop->apidata;
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = aeUringGetSqe(state)) == NULL) return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long long)(uintptr_t)io | AE_URING_IO;
+    sqe->user_data = AE_URING_REMOVE;
+    return 0;
+}
+
+/* Hand the completions reaped by the last poll to their owners. A proc may
+ * start a new request on its aeIo once it got the last completion, or free
+ * it. */
+static int aeApiIoComplete(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+    int i, n = state->ndone;
+
+    state->ndone = 0;
+    for (i = 0; i < n; i++) {
+        aeUringDone *done = &state->done[i];
+        aeIo *io = done->io;
+        char *data = NULL;
+        int bid = -1, flags = 0;
+
+        if (done->flags & IORING_CQE_F_BUFFER) {
+            bid = done->flags >> IORING_CQE_BUFFER_SHIFT;
+            data = state->bufs + (size_t)bid*AE_URING_BUF_LEN;
+        }
+        if (done->flags & IORING_CQE_F_MORE) {
+            flags |= AE_IO_MORE;
+        } else {
+            io->active = 0;
+            io->cancel = 0;
+            eventLoop->ioCount--;
+        }
+        io->proc(eventLoop, io, done->res, data, flags);
+        if (bid != -1) aeUringBufPut(state, bid);
+    }
+    return n;
+}
+
+static char *aeApiName(void) {
+    return "io_uring";
+}
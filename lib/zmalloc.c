@@ -88,11 +88,27 @@ void zlibc_free(void *ptr) {
 
 #endif
 
+/* With thread safeness on, every thread counts in its own zmalloc_local and
+ * folds it into used_memory each time it moved by ZMALLOC_LOCAL_BATCH bytes,
+ * and when the thread exits. Threads allocating at once then share the
+ * counter's cache line once per batch instead of once per call, at the cost
+ * of zmalloc_used_memory() being off by up to a batch per thread. */
+#define ZMALLOC_LOCAL_BATCH (64*1024)
+
+#define update_zmalloc_stat_local(__d) do { \
+    if (!zmalloc_local_registered) zmalloc_local_register(); \
+    zmalloc_local += (__d); \
+    if (zmalloc_local >= ZMALLOC_LOCAL_BATCH || zmalloc_local <= -ZMALLOC_LOCAL_BATCH) { \
+        update_zmalloc_stat_add((size_t)zmalloc_local); \
+        zmalloc_local = 0; \
+    } \
+} while(0)
+
 #define update_zmalloc_stat_alloc(__n) do { \
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
     if (zmalloc_thread_safe) { \
-        update_zmalloc_stat_add(_n); \
+        update_zmalloc_stat_local((long)_n); \
     } else { \
         used_memory += _n; \
     } \
@@ -102,7 +118,7 @@ void zlibc_free(void *ptr) {
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
     if (zmalloc_thread_safe) { \
-        update_zmalloc_stat_sub(_n); \
+        update_zmalloc_stat_local(-(long)_n); \
     } else { \
         used_memory -= _n; \
     } \
@@ -112,6 +128,29 @@ static size_t used_memory = 0;
 static int zmalloc_thread_safe = 0;
 pthread_mutex_t used_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+static __thread long zmalloc_local = 0;
+static __thread int zmalloc_local_registered = 0;
+static pthread_key_t zmalloc_local_key;
+static pthread_once_t zmalloc_local_once = PTHREAD_ONCE_INIT;
+
+/* fold what an exiting thread counted into used_memory. */
+static void zmalloc_local_flush(void *unused) {
+    ((void) unused);
+    update_zmalloc_stat_add((size_t)zmalloc_local);
+    zmalloc_local = 0;
+}
+
+static void zmalloc_local_key_create(void) {
+    pthread_key_create(&zmalloc_local_key, zmalloc_local_flush);
+}
+
+/* a key destructor only runs for a non NULL value. */
+static void zmalloc_local_register(void) {
+    pthread_once(&zmalloc_local_once, zmalloc_local_key_create);
+    pthread_setspecific(zmalloc_local_key, (void *)1);
+    zmalloc_local_registered = 1;
+}
+
 static void zmalloc_default_oom(size_t size) {
     fprintf(stderr, "zmalloc: Out of memory trying to allocate %zu bytes\n",
         size);
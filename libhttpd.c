@@ -26,6 +26,7 @@
 
 #include "lib/ae.h"
 #include "lib/anet.h"
+#include "lib/zmalloc.h"
 
 #include "http_parser.h"
 
@@ -36,14 +37,58 @@
 #include <errno.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#endif
 
 #define LIBHTTPD_BACKLOG 511
-#define LIBHTTPD_READ_LEN 4096
+#define LIBHTTPD_READ_LEN 16384
+#define LIBHTTPD_READ_BUDGET 16
+#define LIBHTTPD_READ_MIN 4096
+#define LIBHTTPD_INPUT_LEN 16384
+#define LIBHTTPD_REQ_FIELDS 24
+#define LIBHTTPD_ARENA_LEN 4096
+#define LIBHTTPD_ARENA_ALIGN 16
+#define LIBHTTPD_SLAB_LEN (2*1024*1024)
+#define LIBHTTPD_DATA_CLASSES 3
 #define LIBHTTPD_LOG_LEN 4096
 #define LIBHTTPD_RES_HEADER_LEN 40960
 #define LIBHTTPD_MAX_ACCEPTS_PER_CALL 1000
 #define LIBHTTPD_NET_IP_STR_LEN 46
+#define LIBHTTPD_QUEUE_LEN 4096
+#define LIBHTTPD_SETSIZE 1024
+#define LIBHTTPD_FILE_SEGMENT (1<<30)
+#define LIBHTTPD_MAX_BODY (8*1024*1024)
+#define LIBHTTPD_BODY_INIT 4096
+#define LIBHTTPD_PIPELINE_MAX 16
+#define LIBHTTPD_KEEPALIVE 60
+#define LIBHTTPD_LOW_WATERMARK (256*1024)
+#define LIBHTTPD_HIGH_WATERMARK (1024*1024)
+#define LIBHTTPD_CONN_MEMORY (16*1024*1024)
+#define LIBHTTPD_STAGE_WRITE 0
+#define LIBHTTPD_STAGE_BEGIN 1
+#define LIBHTTPD_STAGE_END 2
+
+#ifdef IOV_MAX
+#define LIBHTTPD_IOV_MAX IOV_MAX
+#else
+#define LIBHTTPD_IOV_MAX 1024
+#endif
+
+/* iovecs of one completion based send, its storage is a 4KB pool object. */
+#define LIBHTTPD_SEND_IOV 128
 
 #define UNUSED(V) ((void) V)
 
@@ -59,9 +104,50 @@ struct libhttpd_buffer {
     char *data;
     int size;
 
+    /* caller owned data is released through free_cb instead of free. */
+    libhttpd_free_cb free_cb;
+    void *ctx;
+
+    /* file backed segment, size bytes of fd at offset sent with sendfile. */
+    int file;
+    int fd;
+    off_t offset;
+
+    /* loop pools the node and its data came from, 0 for the heap. */
+    struct libhttpd_pool *pool;
+    struct libhttpd_pool *data_pool;
+
     struct libhttpd_buffer *next;
 };
 
+/* a mapping carved into objects of one pool, unmapped with the loop. */
+struct libhttpd_slab {
+    struct libhttpd_slab *next;
+    size_t len;
+};
+
+/* fixed size objects owned by one loop. Freed objects are recycled through
+ * the freelist, new ones are carved from the newest slab as needed so its
+ * pages are only touched once used. Once mmap fails, objects come from the
+ * heap behind a slab header of their own, listed in heap. */
+struct libhttpd_pool {
+    size_t size;
+    void *free;
+    char *pos;
+    char *end;
+    struct libhttpd_slab *slabs;
+    struct libhttpd_slab *heap;
+};
+
+struct libhttpd_shared {
+    char *data;
+    int size;
+    int ref;
+
+    libhttpd_free_cb free_cb;
+    void *ctx;
+};
+
 struct libhttpd_header {
     char *field;
     char *value;
@@ -69,35 +155,175 @@ struct libhttpd_header {
     struct libhttpd_header *next;
 };
 
+/* refcounted block of connection input. Requests point their URL and
+ * headers into the block they were read into, which lives until the last
+ * of them is freed. */
+struct libhttpd_input {
+    int ref;
+    int cap;
+    /* bytes read, and bytes of those parsed. */
+    int size;
+    int pos;
+    char data[];
+};
+
+/* a token of the request head, as offset and length into its input block. */
+struct libhttpd_view {
+    int off;
+    int len;
+};
+
+struct libhttpd_field {
+    struct libhttpd_view name;
+    struct libhttpd_view value;
+};
+
+/* bump allocator backing a request, its response and their headers,
+ * released at once when the response is done. The first block also holds
+ * the arena, overflow goes to blocks chained on more. */
+struct libhttpd_arena {
+    struct libhttpd_arena *more;
+    char *pos;
+    char *end;
+    char data[];
+};
+
 struct libhttpd_request {
     struct libhttpd_connection *conn;
-
-    struct {
-        struct libhttpd_header *head;
-        struct libhttpd_header *tail;
-    } header;
+    struct libhttpd_arena *arena;
+
+    /* URL and headers are views into in, NUL-terminated in place once the
+     * head is parsed. Until then the views move along if the partial head
+     * is carried over to a larger block. */
+    struct libhttpd_input *in;
+    struct libhttpd_view url_view;
+    struct libhttpd_field *fields;
+    int nfields;
+    int fields_cap;
+    /* the last head callback was a header value. */
+    int in_value;
+    int head_done;
+    /* built once the head is parsed: field index + 1 of the first header of
+     * each LIBHTTPD_HEADER_* id, and the other headers in an open addressing
+     * table hashed on their lower-cased name. */
+    int known[LIBHTTPD_HEADER_COUNT];
+    int *other;
+    unsigned other_mask;
 
     char *url;
+    int method;
+    int http_major;
+    int http_minor;
     int content_length;
 
     char *body;
     int body_size;
+    int body_cap;
+
+    /* body handed to a data callback chunk by chunk instead of buffered. */
+    libhttpd_data_cb data_cb;
+    void *data_ctx;
+    /* answered early, the rest of the body is dropped. */
+    int discard;
+
+    long long start;
 };
 
 struct libhttpd_response {
     struct libhttpd_connection *conn;
+    struct libhttpd_arena *arena;
 
     struct {
         struct libhttpd_header *head;
         struct libhttpd_header *tail;
     } header;
 
-    int body_size;
+    struct {
+        struct libhttpd_buffer *head;
+        struct libhttpd_buffer *tail;
+    } body;
+    long long body_size;
+
+    /* headers already sent by libhttpd_response_begin, body streams out. */
+    int begun;
+    int chunked;
+    int ended;
+    /* the connection closes after this response. */
+    int close;
+
+    struct libhttpd_request *req;
+
+    /* libhttpd_response_defer was called, the response may end after the
+     * callback returned. */
+    int deferred;
+    /* the request was handled and the parser moved on, the response owns
+     * req until it is written. */
+    int complete;
+    /* dropped from a closing connection while the handler still holds it,
+     * its output goes nowhere. */
+    int orphan;
+
+    /* called once when the connection drains below the low watermark. */
+    libhttpd_drain_cb drain_cb;
+    void *drain_ctx;
+
+    /* place in the connection's response queue. Output of a response behind
+     * the head is held back until every earlier response ended. */
+    struct libhttpd_response *queue_prev;
+    struct libhttpd_response *queue_next;
+    struct {
+        struct libhttpd_buffer *head;
+        struct libhttpd_buffer *tail;
+    } held;
+
+    /* output staged by threads other than the loop's, guarded by the
+     * loop's mailbox lock and applied by the loop in order. */
+    struct {
+        struct libhttpd_buffer *head;
+        struct libhttpd_buffer *tail;
+    } staged;
+    int begin_pending;
+    int begin_status;
+    int end_pending;
+    int end_status;
+    int mailed;
+    struct libhttpd_response *mail_next;
+};
+
+/* a sendmsg in flight, kept with its iovecs until it completes. */
+struct libhttpd_send {
+    struct msghdr msg;
+    struct iovec iov[LIBHTTPD_SEND_IOV];
 };
 
 struct libhttpd_connection {
     int fd;
     int close;
+    int busy;
+
+    /* completion I/O: the multishot recv and the send in flight. conn is
+     * not recycled while either is active, the kernel still refers to it. */
+    aeIo rio;
+    aeIo wio;
+    struct libhttpd_send *send;
+    /* the recv saw the peer's FIN, handled once the input before it is. */
+    int eof;
+
+    /* every live connection of the loop. */
+    struct libhttpd_connection *prev;
+    struct libhttpd_connection *next;
+
+    /* edge-triggered connections left undrained by the read budget. */
+    struct libhttpd_connection *undrained_prev;
+    struct libhttpd_connection *undrained_next;
+    int undrained;
+
+    /* connections with output queued this loop pass, flushed in beforesleep. */
+    struct libhttpd_connection *flush_prev;
+    struct libhttpd_connection *flush_next;
+    int flush;
+    /* the last write hit EAGAIN, wait for the socket to become writable. */
+    int write_wait;
 
     http_parser parser;
     struct libhttpd *httpd;
@@ -105,29 +331,244 @@ struct libhttpd_connection {
     struct libhttpd_request *req;
     struct libhttpd_response *res;
 
+    /* responses in request order, from the oldest not yet ended to the
+     * request being parsed. Pipelined requests are parsed and handled ahead
+     * up to LIBHTTPD_PIPELINE_MAX, or until output crosses the high
+     * watermark. Then the parser pauses and the rest of the input waits
+     * here. */
+    struct {
+        struct libhttpd_response *head;
+        struct libhttpd_response *tail;
+    } queue;
+    int nqueued;
+    int paused;
+    struct libhttpd_input *in;
+    /* arena of the last finished request, reset for the next one. */
+    struct libhttpd_arena *arena;
+    /* closed with deferred responses outstanding, the last one frees it. */
+    int dead;
+    int norphan;
+
+    /* requests seen, and a request asked to close so nothing after it is
+     * parsed. */
+    int nrequests;
+    int last;
+    /* idle timeout, re-armed lazily from the last read or write progress. */
+    long long timer;
+    long long last_active;
+
     struct {
         struct libhttpd_buffer *head;
         struct libhttpd_buffer *tail;
     } buffer;
     int buffer_pos;
+    /* bytes produced and not written yet, held output included. Above the
+     * high watermark input stops until it falls below the low one. */
+    long long out_size;
+    int throttled;
+    /* bytes held: the input block, buffered request bodies and out_size. */
+    long long mem;
 };
 
+/* single producer (acceptor) single consumer (worker) ring of accepted fds. */
+struct libhttpd_queue {
+    int *fds;
+    unsigned mask;
+    unsigned head;
+    unsigned tail;
+};
+
+typedef struct libhttpd *(* libhttpd_dispatch_fn)(struct libhttpd *acceptor);
+
 struct libhttpd {
     aeEventLoop *el;
     char neterr[LIBHTTPD_NET_IP_STR_LEN];
 
     int fd;
+    pthread_t thread;
+    int nconn;
+
+    int edge;
+    /* accept, recv and memory output go through io_uring completions. */
+    int io;
+    aeIo accept_io;
+    struct libhttpd_connection *undrained;
+    struct libhttpd_connection *flush;
+    struct libhttpd_connection *conns;
+    /* bytes held by the connections of this loop, written by the loop and
+     * read by every loop against the global cap. */
+    long long mem;
+    long long conn_mem_max;
+    /* one drained input block kept for the next connection to read. */
+    struct libhttpd_input *spare;
+
+    /* connections, output buffer nodes and output data up to 16KB come
+     * from these, allocated and freed on the loop only. */
+    int hugepages;
+    struct libhttpd_pool conn_pool;
+    struct libhttpd_pool buffer_pool;
+    struct libhttpd_pool data_pool[LIBHTTPD_DATA_CLASSES];
+
+    /* wall clock derived from the loop's cached monotonic clock, synced
+     * with the real time clock each time its second rolls over. */
+    long long clock_offset;
+    time_t date_sec;
+    char date[32];
+
+    /* worker side of the acceptor handoff, notify also wakes the loop for
+     * responses completed by other threads. */
+    struct libhttpd_queue queue;
+    int notify[2];
+    int pending;
+    pthread_mutex_t mailbox_lock;
+    struct libhttpd_response *mailbox;
+
+    /* acceptor side. */
+    struct libhttpd *workers;
+    int nworkers;
+    unsigned next;
+    libhttpd_dispatch_fn dispatch;
 
     void *ud;
     libhttpd_cb cb;
+    libhttpd_cb headers_cb;
+    long long max_body;
+    long long keepalive;
+    int max_requests;
+    long long low_watermark;
+    long long high_watermark;
+    int notsent_lowat;
 };
 
 static int g_log_level = LIBHTTPD_LOG_INFO;
+static int g_threads = 1;
+static int g_dispatch = LIBHTTPD_DISPATCH_REUSEPORT;
+static int g_nofile = 0;
+static int g_maxfds = LIBHTTPD_SETSIZE;
+static int g_edge = 0;
+static libhttpd_cb g_headers_cb = 0;
+static long long g_max_body = LIBHTTPD_MAX_BODY;
+static int g_keepalive = LIBHTTPD_KEEPALIVE;
+static int g_max_requests = 0;
+static int g_low_watermark = LIBHTTPD_LOW_WATERMARK;
+static int g_high_watermark = LIBHTTPD_HIGH_WATERMARK;
+static int g_notsent_lowat = 0;
+static int g_hugepages = 0;
+static long long g_conn_mem_max = LIBHTTPD_CONN_MEMORY;
+static long long g_mem_max = 0;
+
+/* the worker loops, summed for the global memory cap. */
+static struct libhttpd *g_httpds = 0;
+static int g_nhttpds = 0;
+
+/* output data size classes of the loop pools. */
+static const int g_data_class[LIBHTTPD_DATA_CLASSES] = {512, 4096, 16384};
+
+/* names of the LIBHTTPD_HEADER_* ids. */
+static const char *g_header_names[LIBHTTPD_HEADER_COUNT] = {
+    "host", "content-length", "content-type", "connection", "accept",
+    "accept-encoding", "accept-language", "cookie", "authorization",
+    "user-agent", "transfer-encoding", "if-modified-since", "if-none-match",
+    "range", "referer", "origin", "upgrade", "expect", "cache-control",
+    "x-forwarded-for", "x-real-ip", "content-encoding", "if-range", "pragma",
+    "te", "keep-alive", "sec-websocket-key", "x-request-id",
+};
+
+/* id + 1 by __httpd_header_known hash, collision free over the names
+ * above. Regenerate it when adding one, searching multipliers that keep
+ * the hash perfect. */
+static const unsigned char g_header_slots[64] = {
+     4,  0, 10,  0,  7, 15,  0, 14,  0, 23,  0,  0,  0,  0, 11,  0,
+     0,  0,  5,  0,  0,  0, 18,  1, 20, 12,  0, 26,  9,  0, 17,  0,
+     0,  0,  0,  6,  0, 27,  0,  0, 25, 28,  0,  0,  0, 22, 13,  0,
+    16, 21, 19,  0,  0,  0,  3,  0,  2,  0, 24,  0,  0,  8,  0,  0,
+};
+
+static struct libhttpd_allocator g_allocator = {zmalloc, zrealloc, zfree};
+
+/* the worker whose loop runs on this thread. */
+static __thread struct libhttpd *t_httpd = 0;
 
 void libhttpd__loglevel(int level) {
     g_log_level = level;
 }
 
+void libhttpd__allocator(const struct libhttpd_allocator *allocator) {
+    g_allocator = *allocator;
+}
+
+void *libhttpd_malloc(size_t size) {
+    return g_allocator.malloc(size);
+}
+
+void *libhttpd_realloc(void *ptr, size_t size) {
+    return g_allocator.realloc(ptr, size);
+}
+
+void libhttpd_free(void *ptr) {
+    g_allocator.free(ptr);
+}
+
+void libhttpd__threads(int threads) {
+    g_threads = threads;
+}
+
+void libhttpd__dispatch(int dispatch) {
+    g_dispatch = dispatch;
+}
+
+void libhttpd__nofile(int nofile) {
+    g_nofile = nofile;
+}
+
+void libhttpd__edge(int edge) {
+    g_edge = edge;
+}
+
+void libhttpd__on_request_headers(libhttpd_cb cb) {
+    g_headers_cb = cb;
+}
+
+void libhttpd__max_body(long long size) {
+    g_max_body = size;
+}
+
+void libhttpd__keepalive(int seconds) {
+    g_keepalive = seconds;
+}
+
+void libhttpd__max_requests(int requests) {
+    g_max_requests = requests;
+}
+
+void libhttpd__watermarks(int low, int high) {
+    g_low_watermark = low;
+    g_high_watermark = high;
+}
+
+void libhttpd__notsent_lowat(int bytes) {
+    g_notsent_lowat = bytes;
+}
+
+void libhttpd__hugepages(int on) {
+    g_hugepages = on;
+}
+
+void libhttpd__memory(long long conn_max, long long total_max) {
+    g_conn_mem_max = conn_max;
+    g_mem_max = total_max;
+}
+
+long long libhttpd_memory_used(void) {
+    long long total = 0;
+    int i;
+
+    for (i = 0; i < g_nhttpds; i++) {
+        total += __atomic_load_n(&g_httpds[i].mem, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
 static void
 __log(int level, const char *fmt, ...) {
     int n;
@@ -143,9 +584,8 @@ __log(int level, const char *fmt, ...) {
     if (level < g_log_level) return;
     n = snprintf(logbuf, LIBHTTPD_LOG_LEN, "[%s] ", __libhttpd_loglevel_strings[level]);
     va_start(ap, fmt);
-    n = vsnprintf(logbuf+n, LIBHTTPD_LOG_LEN-n, fmt, ap);
+    vsnprintf(logbuf+n, LIBHTTPD_LOG_LEN-n, fmt, ap);
     va_end(ap);
-    logbuf[n] = '\0';
     fprintf(stdout, "%s\n", logbuf);
 }
 
@@ -159,276 +599,1399 @@ http_status_str(enum http_status s) {
     }
 }
 
-
+/* offset of the real time clock from the loop clock, which follows steps
+ * of the wall clock and time spent suspended. */
 static void
-__httpd_request_free(struct libhttpd_request *req) {
-    struct libhttpd_header *header;
+__httpd_clock_sync(struct libhttpd *httpd) {
+    struct timespec ts;
 
-    header = req->header.head;
-    while (header) {
-        struct libhttpd_header *next;
-        if (header->field) free(header->field);
-        if (header->value) free(header->value);
-        next = header->next;
-        free(header);
-        header = next;
-    }
-    if (req->url) free(req->url);
-    if (req->body) free(req->body);
-    free(req);
-    __DEBUG("__httpd_request_free");
+    clock_gettime(CLOCK_REALTIME, &ts);
+    httpd->clock_offset = (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000 - aeGetMonotonicTime(httpd->el);
 }
 
-static void
-__httpd_response_free(struct libhttpd_response *res) {
-    struct libhttpd_header *header;
-
-    header = res->header.head;
-    while (header) {
-        struct libhttpd_header *next;
-        if (header->field) free(header->field);
-        if (header->value) free(header->value);
-        next = header->next;
-        free(header);
-        header = next;
+/* format the Date header from the loop clock, at most once per second. */
+static const char *
+__httpd_date(struct libhttpd *httpd) {
+    struct tm tm;
+    time_t now = (time_t)((httpd->clock_offset + aeGetMonotonicTime(httpd->el)) / 1000);
+
+    if (now != httpd->date_sec) {
+        __httpd_clock_sync(httpd);
+        now = (time_t)((httpd->clock_offset + aeGetMonotonicTime(httpd->el)) / 1000);
+        httpd->date_sec = now;
+        gmtime_r(&now, &tm);
+        strftime(httpd->date, sizeof httpd->date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
     }
+    return httpd->date;
+}
 
-    free(res);
-    __DEBUG("__httpd_response_free");
+static int
+__httpd_lower(int c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a'-'A') : c;
 }
 
+/* LIBHTTPD_HEADER_* id of a header name, -1 for the others. Three bytes and
+ * the length pick the only candidate, one compare confirms it. */
+static int
+__httpd_header_known(const char *name, int len) {
+    const unsigned char *s = (const unsigned char *)name;
+    int id;
+
+    if (len == 0) return -1;
+    id = g_header_slots[(__httpd_lower(s[0]) + 19*__httpd_lower(s[len-1]) + 8*len
+                         + __httpd_lower(s[len/2])) & 63] - 1;
+    if (id == -1 || 0 != strcasecmp(name, g_header_names[id])) return -1;
+    return id;
+}
 
-static void
-__httpd_connection_free(struct libhttpd_connection *conn) {
-    struct libhttpd_buffer *buffer;
+/* FNV-1a of the lower-cased name. */
+static unsigned
+__httpd_header_hash(const char *name) {
+    const unsigned char *s = (const unsigned char *)name;
+    unsigned h = 2166136261u;
 
-    if (conn->buffer.head && conn->close == 0) {
-        conn->close = 1;
-        return;
+    for (; *s; s++) {
+        h ^= (unsigned)__httpd_lower(*s);
+        h *= 16777619u;
     }
+    return h;
+}
 
-    aeDeleteFileEvent(conn->httpd->el, conn->fd, AE_READABLE);
-    aeDeleteFileEvent(conn->httpd->el, conn->fd, AE_WRITABLE);
-    close(conn->fd);
+static struct libhttpd_input *
+__httpd_input_new(struct libhttpd *httpd, int cap) {
+    struct libhttpd_input *in;
 
-    buffer = conn->buffer.head;
-    while (buffer) {
-        struct libhttpd_buffer *next;
-        if (buffer->data) free(buffer->data);
-        next = buffer->next;
-        free(buffer);
-        buffer = next;
+    if (cap == LIBHTTPD_INPUT_LEN && httpd->spare) {
+        in = httpd->spare;
+        httpd->spare = 0;
+    } else {
+        in = (struct libhttpd_input *)libhttpd_malloc(sizeof *in + cap);
+        in->cap = cap;
     }
-
-    if (conn->req) __httpd_request_free(conn->req);
-    if (conn->res) __httpd_response_free(conn->res);
-    free(conn);
-    __DEBUG("__httpd_connection_free");
+    in->ref = 1;
+    in->size = in->pos = 0;
+    return in;
 }
 
 static void
-__libhttpd_connection_write(struct libhttpd_connection *conn, int writeable);
-
-static void
-__httpd_write(aeEventLoop *el, int fd, void *privdata, int mask) {
-    struct libhttpd_connection *conn;
-    UNUSED(el);
-    UNUSED(mask);
-
-    conn = (struct libhttpd_connection *)privdata;
-
-    __DEBUG("__httpd_write");
-    __libhttpd_connection_write(conn, 1);
+__httpd_input_unref(struct libhttpd *httpd, struct libhttpd_input *in) {
+    if (--in->ref > 0) return;
+    if (in->cap == LIBHTTPD_INPUT_LEN && !httpd->spare) {
+        httpd->spare = in;
+    } else {
+        libhttpd_free(in);
+    }
 }
 
-static void
-__libhttpd_connection_write(struct libhttpd_connection *conn, int writeable) {
-    struct libhttpd *httpd;
-    struct libhttpd_buffer *buffer;
-    ssize_t nwritten = 0;
+static int
+__httpd_slab_new(struct libhttpd *httpd, struct libhttpd_pool *pool) {
+    struct libhttpd_slab *slab;
+    void *p = MAP_FAILED;
 
-    httpd = conn->httpd;
-    while (conn->buffer.head) {
-        buffer = conn->buffer.head;
-        nwritten = write(conn->fd, buffer->data+conn->buffer_pos, buffer->size-conn->buffer_pos);
-        __DEBUG("__libhttpd_connection_write %d", nwritten);
-        if (nwritten <= 0) break;
-        conn->buffer_pos += nwritten;
-        if (conn->buffer_pos == buffer->size) {
-            conn->buffer_pos = 0;
-            conn->buffer.head = buffer->next;
-            free(buffer->data);
-            free(buffer);
-        }
+#ifdef MAP_HUGETLB
+    if (httpd->hugepages) {
+        p = mmap(0, LIBHTTPD_SLAB_LEN, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
     }
-    if (nwritten == -1) {
-        if (errno == EAGAIN) {
-            nwritten = 0;
-        } else {
-            __WARN("__libhttpd_connection_write error: %s", strerror(errno));
-            conn->close = 1;
-            __httpd_connection_free(conn);
-            return;
+#endif
+    if (p == MAP_FAILED) {
+        p = mmap(0, LIBHTTPD_SLAB_LEN, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            __WARN("mmap slab: %s", strerror(errno));
+            return -1;
         }
+#ifdef MADV_HUGEPAGE
+        /* no reserved huge pages, let transparent huge pages back it. */
+        if (httpd->hugepages) madvise(p, LIBHTTPD_SLAB_LEN, MADV_HUGEPAGE);
+#endif
     }
-    if (!conn->buffer.head) {
-        if (conn->close == 1) {
-            __httpd_connection_free(conn);
-            return;
-        }
-        conn->buffer_pos = 0;
-        if (writeable) {
-            aeDeleteFileEvent(httpd->el, conn->fd, AE_WRITABLE);
-        }
-    } else {
-        if (aeCreateFileEvent(httpd->el, conn->fd, AE_WRITABLE, __httpd_write, conn) == AE_ERR) {
-            __WARN("aeCreateFileEvent error: %s", strerror(errno));
-            conn->close = 1;
-            __httpd_connection_free(conn);
-        }
+    slab = (struct libhttpd_slab *)p;
+    slab->len = LIBHTTPD_SLAB_LEN;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->pos = (char *)p + 64;
+    pool->end = (char *)p + LIBHTTPD_SLAB_LEN;
+    return 0;
+}
+
+static void *
+__httpd_pool_get(struct libhttpd *httpd, struct libhttpd_pool *pool) {
+    struct libhttpd_slab *slab;
+    void *obj;
+
+    if ((obj = pool->free)) {
+        pool->free = *(void **)obj;
+        return obj;
+    }
+    if ((size_t)(pool->end - pool->pos) < pool->size && __httpd_slab_new(httpd, pool) != 0) {
+        /* out of mappings, a heap object is recycled through the freelist
+         * all the same and freed with the pool. */
+        slab = (struct libhttpd_slab *)libhttpd_malloc(64 + pool->size);
+        slab->len = 64 + pool->size;
+        slab->next = pool->heap;
+        pool->heap = slab;
+        return (char *)slab + 64;
     }
+    obj = pool->pos;
+    pool->pos += pool->size;
+    return obj;
 }
 
-const char *libhttpd_request_method(struct libhttpd_request *req) {
-    return http_method_str(req->conn->parser.method);
+static void
+__httpd_pool_put(struct libhttpd_pool *pool, void *obj) {
+    *(void **)obj = pool->free;
+    pool->free = obj;
 }
 
-const char *libhttpd_request_url(struct libhttpd_request *req) {
-    return req->url;
+static void
+__httpd_pool_init(struct libhttpd_pool *pool, size_t size) {
+    memset(pool, 0, sizeof *pool);
+    /* keep objects cache line aligned. */
+    pool->size = (size + 63) & ~(size_t)63;
 }
 
-const char *libhttpd_request_header(struct libhttpd_request *req, const char *field) {
-    struct libhttpd_header *header;
+static void
+__httpd_pool_destroy(struct libhttpd_pool *pool) {
+    struct libhttpd_slab *slab;
 
-    header = req->header.head;
-    while (header) {
-        if (0 == strcasecmp(header->field, field)) {
-            return header->value;
-        }
-        header = header->next;
+    while ((slab = pool->slabs)) {
+        pool->slabs = slab->next;
+        munmap(slab, slab->len);
+    }
+    while ((slab = pool->heap)) {
+        pool->heap = slab->next;
+        libhttpd_free(slab);
     }
-    return 0;
 }
 
-const char *libhttpd_request_body(struct libhttpd_request *req, int *size) {
-    *size = req->body_size;
-    return req->body;
+/* the loop of res when called on it, off the loop output comes from the
+ * heap as the pools are not shared. */
+static struct libhttpd *
+__httpd_local(struct libhttpd_response *res) {
+    return t_httpd == res->conn->httpd ? t_httpd : 0;
 }
 
+static struct libhttpd_arena *
+__httpd_arena_new(struct libhttpd_connection *conn) {
+    struct libhttpd_arena *arena;
 
-void libhttpd_response_header(struct libhttpd_response *res, const char *field, const char *value) {
-    struct libhttpd_header *header;
-
-    if (!field) return;
-    header = res->header.head;
-    while (header) {
-        if (0 == strcasecmp(header->field, field)) {
-            if (header->value) {
-                free(header->value);
-                header->value = 0;
-            }
-            if (value) header->value = strdup(value);
-            __DEBUG("libhttpd_response_header set header %s:%s", field, value);
-            return;
-        }
-        header = header->next;
+    if ((arena = conn->arena)) {
+        conn->arena = 0;
+    } else {
+        /* arenas start on the loop and end there, the first block is a
+         * pooled 4KB chunk. */
+        arena = (struct libhttpd_arena *)__httpd_pool_get(conn->httpd, &conn->httpd->data_pool[1]);
     }
+    arena->more = 0;
+    arena->pos = arena->data;
+    arena->end = (char *)arena + LIBHTTPD_ARENA_LEN;
+    return arena;
+}
 
-    if (!value) return;
-    header = (struct libhttpd_header *)malloc(sizeof *header);
-    memset(header, 0, sizeof *header);
-
-    header->field = strdup(field);
-    header->value = strdup(value);
-    if (res->header.head == 0) {
-        res->header.head = res->header.tail = header;
-    } else {
-        res->header.tail->next = header;
-        res->header.tail = header;
+static void *
+__httpd_arena_alloc(struct libhttpd_arena *arena, size_t size) {
+    struct libhttpd_arena *block;
+    uintptr_t pos;
+    int large;
+
+    pos = ((uintptr_t)arena->pos + LIBHTTPD_ARENA_ALIGN-1) & ~(uintptr_t)(LIBHTTPD_ARENA_ALIGN-1);
+    /* aligning may step past an unaligned end. */
+    if (pos <= (uintptr_t)arena->end && size <= (size_t)((uintptr_t)arena->end - pos)) {
+        arena->pos = (char *)pos + size;
+        return (void *)pos;
     }
-    __DEBUG("libhttpd_response_header add header %s:%s", field, value);
+    /* a large allocation gets a block of its own, the rest of the current
+     * block stays in use. */
+    large = size > LIBHTTPD_ARENA_LEN/4;
+    block = (struct libhttpd_arena *)libhttpd_malloc(large ? sizeof *block + size + LIBHTTPD_ARENA_ALIGN : LIBHTTPD_ARENA_LEN);
+    block->more = arena->more;
+    arena->more = block;
+    pos = ((uintptr_t)block->data + LIBHTTPD_ARENA_ALIGN-1) & ~(uintptr_t)(LIBHTTPD_ARENA_ALIGN-1);
+    if (!large) {
+        arena->pos = (char *)pos + size;
+        arena->end = (char *)block + LIBHTTPD_ARENA_LEN;
+    }
+    return (void *)pos;
 }
 
-char *libhttpd_response_write(struct libhttpd_response *res, const char *data, int size) {
-    struct libhttpd_connection *conn;
-    struct libhttpd_buffer *buffer;
+static char *
+__httpd_arena_strdup(struct libhttpd_arena *arena, const char *str) {
+    size_t len = strlen(str) + 1;
 
-    conn = res->conn;
+    return (char *)memcpy(__httpd_arena_alloc(arena, len), str, len);
+}
 
-    buffer = (struct libhttpd_buffer *)malloc(sizeof *buffer);
-    memset(buffer, 0, sizeof *buffer);
-    buffer->data = malloc(size);
-    memcpy(buffer->data, data, size);
-    buffer->size = size;
+/* overflow blocks go back to the allocator, the first one is kept by the
+ * connection for its next request. */
+static void
+__httpd_arena_free(struct libhttpd_connection *conn, struct libhttpd_arena *arena) {
+    struct libhttpd_arena *block;
 
-    if (conn->buffer.head == 0) {
-        conn->buffer.head = conn->buffer.tail = buffer;
+    while ((block = arena->more)) {
+        arena->more = block->more;
+        libhttpd_free(block);
+    }
+    if (!conn->dead && !conn->arena) {
+        conn->arena = arena;
     } else {
-        conn->buffer.tail->next = buffer;
-        conn->buffer.tail = buffer;
+        __httpd_pool_put(&conn->httpd->data_pool[1], arena);
     }
+}
 
-    res->body_size += size;
-    __DEBUG("libhttpd_response_write size:%d", size);
+static void
+__httpd_free_none(void *ctx) {
+    UNUSED(ctx);
+}
 
-    return buffer->data;
+/* output is released on the loop only, so pooled nodes and data go back to
+ * the pools they came from. */
+static void
+__httpd_buffer_release(struct libhttpd_buffer *buffer) {
+    if (buffer->free_cb) buffer->free_cb(buffer->ctx);
+    else if (buffer->file) close(buffer->fd);
+    else if (buffer->data_pool) __httpd_pool_put(buffer->data_pool, buffer->data);
+    else if (buffer->data) libhttpd_free(buffer->data);
+    if (buffer->pool) __httpd_pool_put(buffer->pool, buffer);
+    else libhttpd_free(buffer);
 }
 
-void libhttpd_response_end(struct libhttpd_response *res, int status) {
-    struct libhttpd_connection *conn;
-    struct libhttpd_header *header;
-    struct libhttpd_buffer *buffer;
-    int size;
-    char buff[LIBHTTPD_RES_HEADER_LEN];
-    int buff_size = LIBHTTPD_RES_HEADER_LEN;
+static void
+__httpd_buffer_free(struct libhttpd_buffer *buffer) {
+    while (buffer) {
+        struct libhttpd_buffer *next;
+        next = buffer->next;
+        __httpd_buffer_release(buffer);
+        buffer = next;
+    }
+}
 
-    conn = res->conn;
-    size = snprintf(buff, buff_size, "HTTP/1.1 %s\r\n", http_status_str(status));
+static long long
+__httpd_chain_size(struct libhttpd_buffer *buffer) {
+    long long size = 0;
 
-    header = res->header.head;
-    while (header) {
-        if (header->value) {
-            size += snprintf(buff+size, buff_size-size, "%s: %s\r\n", header->field, header->value);
-        }
-        header = header->next;
-    }
-    size += snprintf(buff+size, buff_size-size, "Content-Length: %d\r\n\r\n", res->body_size);
+    for (; buffer; buffer = buffer->next) size += buffer->size;
+    return size;
+}
 
-    buffer = (struct libhttpd_buffer *)malloc(sizeof *buffer);
-    memset(buffer, 0, sizeof *buffer);
-    buffer->data = malloc(size);
-    memcpy(buffer->data, buff, size);
-    buffer->size = size;
+/* account delta bytes to conn and its loop, on the loop only. */
+static void
+__httpd_mem(struct libhttpd_connection *conn, long long delta) {
+    struct libhttpd *httpd = conn->httpd;
 
-    buffer->next = conn->buffer.head;
-    conn->buffer.head = buffer;
+    conn->mem += delta;
+    __atomic_store_n(&httpd->mem, httpd->mem + delta, __ATOMIC_RELAXED);
+}
 
-    __libhttpd_connection_write(conn, 0);
-    __DEBUG("libhttpd_response_end %s", http_status_str(status));
+static void
+__httpd_out(struct libhttpd_connection *conn, long long delta) {
+    conn->out_size += delta;
+    __httpd_mem(conn, delta);
 }
 
+/* free a response and its request, the arena takes everything but the
+ * input block, the body and the output not written. */
+static void
+__httpd_message_free(struct libhttpd_response *res) {
+    struct libhttpd_request *req = res->req;
+
+    if (req->in) __httpd_input_unref(res->conn->httpd, req->in);
+    if (req->body) {
+        /* a closed connection gave up its accounting already. */
+        if (!res->conn->dead) __httpd_mem(res->conn, -req->body_cap);
+        libhttpd_free(req->body);
+    }
+    __httpd_buffer_free(res->body.head);
+    __httpd_buffer_free(res->held.head);
+    __httpd_buffer_free(res->staged.head);
+    __httpd_arena_free(res->conn, res->arena);
+    __DEBUG("__httpd_message_free");
+}
 
-static int
-__httpd_on_message_begin(http_parser *p) {
-    struct libhttpd_connection *conn;
+
+static void
+__httpd_undrained_add(struct libhttpd_connection *conn) {
+    struct libhttpd *httpd = conn->httpd;
+
+    if (conn->undrained) return;
+    conn->undrained = 1;
+    conn->undrained_prev = 0;
+    conn->undrained_next = httpd->undrained;
+    if (httpd->undrained) httpd->undrained->undrained_prev = conn;
+    httpd->undrained = conn;
+}
+
+static void
+__httpd_undrained_del(struct libhttpd_connection *conn) {
+    struct libhttpd *httpd = conn->httpd;
+
+    if (!conn->undrained) return;
+    conn->undrained = 0;
+    if (conn->undrained_prev) conn->undrained_prev->undrained_next = conn->undrained_next;
+    else httpd->undrained = conn->undrained_next;
+    if (conn->undrained_next) conn->undrained_next->undrained_prev = conn->undrained_prev;
+}
+
+static void
+__httpd_flush_add(struct libhttpd_connection *conn) {
+    struct libhttpd *httpd = conn->httpd;
+
+    if (conn->flush || conn->dead) return;
+    conn->flush = 1;
+    conn->flush_prev = 0;
+    conn->flush_next = httpd->flush;
+    if (httpd->flush) httpd->flush->flush_prev = conn;
+    httpd->flush = conn;
+}
+
+static void
+__httpd_flush_del(struct libhttpd_connection *conn) {
+    struct libhttpd *httpd = conn->httpd;
+
+    if (!conn->flush) return;
+    conn->flush = 0;
+    if (conn->flush_prev) conn->flush_prev->flush_next = conn->flush_next;
+    else httpd->flush = conn->flush_next;
+    if (conn->flush_next) conn->flush_next->flush_prev = conn->flush_prev;
+}
+
+static void
+__httpd_pipeline_add(struct libhttpd_connection *conn, struct libhttpd_response *res) {
+    res->queue_next = 0;
+    res->queue_prev = conn->queue.tail;
+    if (conn->queue.tail) conn->queue.tail->queue_next = res;
+    else conn->queue.head = res;
+    conn->queue.tail = res;
+    conn->nqueued++;
+}
+
+static void
+__httpd_pipeline_del(struct libhttpd_connection *conn, struct libhttpd_response *res) {
+    if (res->queue_prev) res->queue_prev->queue_next = res->queue_next;
+    else conn->queue.head = res->queue_next;
+    if (res->queue_next) res->queue_next->queue_prev = res->queue_prev;
+    else conn->queue.tail = res->queue_prev;
+    conn->nqueued--;
+}
+
+/* empty the queue of a connection about to close. Deferred responses the
+ * handler still holds become orphans and keep conn until they end. */
+static void
+__httpd_pipeline_drop(struct libhttpd_connection *conn) {
+    struct libhttpd_response *res;
+
+    while ((res = conn->queue.head)) {
+        __httpd_pipeline_del(conn, res);
+        __httpd_out(conn, -__httpd_chain_size(res->held.head));
+        if (res->deferred && !res->ended) {
+            __httpd_buffer_free(res->held.head);
+            res->held.head = res->held.tail = 0;
+            res->orphan = 1;
+            conn->norphan++;
+        } else {
+            __httpd_message_free(res);
+        }
+    }
+}
+
+/* recycle a closed conn once neither a deferred response nor the kernel
+ * refers to it any more. */
+static void
+__httpd_connection_put(struct libhttpd_connection *conn) {
+    if (conn->norphan || conn->rio.active || conn->wio.active) return;
+    __httpd_pool_put(&conn->httpd->conn_pool, conn);
+    __DEBUG("__httpd_connection_free");
+}
+
+static void
+__httpd_connection_free(struct libhttpd_connection *conn) {
+    if (conn->buffer.head && conn->close == 0) {
+        conn->close = 1;
+        return;
+    }
+
+    /* still inside the read loop, it frees conn once the parser returns. */
+    if (conn->busy) {
+        conn->close = 2;
+        return;
+    }
+
+    if (!conn->dead) {
+        __httpd_undrained_del(conn);
+        __httpd_flush_del(conn);
+        aeDeleteFileEvent(conn->httpd->el, conn->fd, AE_READABLE|AE_WRITABLE);
+        if (conn->httpd->io) {
+            aeIoCancel(conn->httpd->el, &conn->rio);
+            aeIoCancel(conn->httpd->el, &conn->wio);
+        }
+        close(conn->fd);
+        conn->fd = -1;
+        conn->dead = 1;
+
+        /* output still being sent is freed by __httpd_sent. */
+        if (!conn->wio.active) {
+            __httpd_buffer_free(conn->buffer.head);
+            conn->buffer.head = conn->buffer.tail = 0;
+        }
+        if (conn->in) __httpd_input_unref(conn->httpd, conn->in);
+        conn->in = 0;
+        if (conn->arena) __httpd_pool_put(&conn->httpd->data_pool[1], conn->arena);
+        conn->arena = 0;
+
+        if (conn->timer != -1) aeDeleteTimeEvent(conn->httpd->el, conn->timer);
+        conn->timer = -1;
+
+        __httpd_pipeline_drop(conn);
+        conn->req = 0;
+        conn->res = 0;
+        /* bodies of orphans are released later, unaccounted. */
+        __httpd_mem(conn, -conn->mem);
+        if (conn->prev) conn->prev->next = conn->next;
+        else conn->httpd->conns = conn->next;
+        if (conn->next) conn->next->prev = conn->prev;
+        __atomic_sub_fetch(&conn->httpd->nconn, 1, __ATOMIC_RELAXED);
+    }
+
+    /* deferred responses or the kernel still point at conn, the last to
+     * let go frees it. */
+    __httpd_connection_put(conn);
+}
+
+static void
+__libhttpd_connection_write(struct libhttpd_connection *conn);
+
+static void
+__httpd_write(aeEventLoop *el, int fd, void *privdata, int mask) {
+    struct libhttpd_connection *conn;
+    UNUSED(el);
+    UNUSED(mask);
+
+    conn = (struct libhttpd_connection *)privdata;
+
+    __DEBUG("__httpd_write");
+    __libhttpd_connection_write(conn);
+}
+
+/* send a file segment from pos without copying it through user space. */
+static ssize_t
+__httpd_sendfile(int fd, struct libhttpd_buffer *buffer, int pos) {
+    ssize_t n;
+#ifdef __linux__
+    off_t offset = buffer->offset+pos;
+
+    n = sendfile(fd, buffer->fd, &offset, buffer->size-pos);
+#else
+    char buff[LIBHTTPD_READ_LEN];
+    size_t len = buffer->size-pos;
+
+    if (len > sizeof(buff)) len = sizeof(buff);
+    n = pread(buffer->fd, buff, len, buffer->offset+pos);
+    if (n > 0) n = write(fd, buff, n);
+#endif
+    /* the file shrank under us, the promised length can't be sent. */
+    if (n == 0) {
+        errno = EIO;
+        return -1;
+    }
+    return n;
+}
+
+static void
+__httpd_read(aeEventLoop *el, int fd, void *privdata, int mask);
+
+/* parse and read again once neither the pipeline limit nor backpressure
+ * holds input back, from beforesleep with the input left over and whatever
+ * arrived meanwhile. */
+static void
+__httpd_input_resume(struct libhttpd_connection *conn) {
+    struct libhttpd *httpd = conn->httpd;
+
+    if (conn->throttled || conn->close) return;
+    if (conn->paused) {
+        if (conn->last || conn->nqueued >= LIBHTTPD_PIPELINE_MAX) return;
+        conn->paused = 0;
+        http_parser_pause(&conn->parser, 0);
+    }
+    if (!httpd->edge && !httpd->io
+        && aeCreateFileEvent(httpd->el, conn->fd, AE_READABLE, __httpd_read, conn) == AE_ERR) {
+        __WARN("aeCreateFileEvent error: %s", strerror(errno));
+        conn->close = 1;
+        return;
+    }
+    __httpd_undrained_add(conn);
+}
+
+/* stop taking input. A recv in flight still delivers what the kernel read
+ * before the cancel reached it, at most the loop's ring of recv buffers. */
+static void
+__httpd_input_stop(struct libhttpd_connection *conn) {
+    struct libhttpd *httpd = conn->httpd;
+
+    if (httpd->io) aeIoCancel(httpd->el, &conn->rio);
+    else aeDeleteFileEvent(httpd->el, conn->fd, AE_READABLE);
+}
+
+/* completion I/O: keep a recv armed while input is wanted. Returns -1 once
+ * conn is freed. */
+static int
+__httpd_input_start(struct libhttpd_connection *conn) {
+    if (conn->rio.active || conn->eof || conn->close || conn->paused || conn->throttled) return 0;
+    if (aeIoRecv(conn->httpd->el, &conn->rio) == AE_ERR) {
+        __WARN("__httpd_input_start aeIoRecv failed");
+        conn->close = 1;
+        __httpd_connection_free(conn);
+        return -1;
+    }
+    return 0;
+}
+
+/* output fell below the low watermark: tell waiting producers, and take
+ * requests again. */
+static void
+__httpd_unthrottle(struct libhttpd_connection *conn) {
+    struct libhttpd_response *res, *next;
+    libhttpd_drain_cb cb;
+
+    __atomic_store_n(&conn->throttled, 0, __ATOMIC_RELAXED);
+    /* a producer writing from its callback may fail the connection, it is
+     * freed once they all returned. */
+    conn->busy = 1;
+    for (res = conn->queue.head; res && conn->close != 2; res = next) {
+        next = res->queue_next;
+        if ((cb = res->drain_cb)) {
+            res->drain_cb = 0;
+            cb(res->drain_ctx, res);
+        }
+    }
+    conn->busy = 0;
+    if (conn->close == 2) {
+        conn->close = 1;
+        __httpd_connection_free(conn);
+        return;
+    }
+    __httpd_input_resume(conn);
+}
+
+/* drop the buffers written in full, keep the offset into the last. */
+static void
+__httpd_written(struct libhttpd_connection *conn, ssize_t nwritten) {
+    struct libhttpd_buffer *buffer;
+
+    conn->last_active = aeGetMonotonicTime(conn->httpd->el);
+    __httpd_out(conn, -nwritten);
+    conn->buffer_pos += nwritten;
+    while ((buffer = conn->buffer.head) && conn->buffer_pos >= buffer->size) {
+        conn->buffer_pos -= buffer->size;
+        conn->buffer.head = buffer->next;
+        __httpd_buffer_release(buffer);
+    }
+}
+
+/* completion I/O: hand the memory buffers up to the next file segment to
+ * the kernel in one sendmsg, they stay queued until __httpd_sent. */
+static int
+__httpd_connection_send(struct libhttpd_connection *conn) {
+    struct libhttpd *httpd = conn->httpd;
+    struct libhttpd_buffer *buffer;
+    struct libhttpd_send *send;
+    int iovcnt, pos = conn->buffer_pos;
+
+    send = (struct libhttpd_send *)__httpd_pool_get(httpd, &httpd->data_pool[1]);
+    memset(&send->msg, 0, sizeof send->msg);
+    buffer = conn->buffer.head;
+    for (iovcnt = 0; buffer && !buffer->file && iovcnt < LIBHTTPD_SEND_IOV; iovcnt++) {
+        send->iov[iovcnt].iov_base = buffer->data+pos;
+        send->iov[iovcnt].iov_len = buffer->size-pos;
+        buffer = buffer->next;
+        pos = 0;
+    }
+    send->msg.msg_iov = send->iov;
+    send->msg.msg_iovlen = iovcnt;
+    if (aeIoSendmsg(httpd->el, &conn->wio, &send->msg) == AE_ERR) {
+        __httpd_pool_put(&httpd->data_pool[1], send);
+        return -1;
+    }
+    conn->send = send;
+    return 0;
+}
+
+/* write as much output as the socket takes, gathering up to IOV_MAX
+ * memory buffers per writev and sending file segments with sendfile. The
+ * writable handler is only installed when data is left unsent and only
+ * removed once everything is out, so a connection keeping up with its
+ * output costs no epoll_ctl. With completion I/O memory buffers go out
+ * through a sendmsg on the ring instead and the rest of the output waits
+ * for it to complete. */
+static void
+__libhttpd_connection_write(struct libhttpd_connection *conn) {
+    struct libhttpd *httpd;
+    struct libhttpd_buffer *buffer;
+    struct iovec iov[LIBHTTPD_IOV_MAX];
+    ssize_t nwritten = 0, want;
+    int iovcnt, pos;
+
+    httpd = conn->httpd;
+    __httpd_flush_del(conn);
+    /* gone, or failed while a handler is still streaming into it. */
+    if (conn->dead || conn->close == 2) return;
+    if (conn->wio.active) return;
+    while (conn->buffer.head) {
+        want = 0;
+        pos = conn->buffer_pos;
+        buffer = conn->buffer.head;
+        if (buffer->file) {
+            want = buffer->size-pos;
+            nwritten = __httpd_sendfile(conn->fd, buffer, pos);
+        } else if (httpd->io && __httpd_connection_send(conn) == 0) {
+            break;
+        } else {
+            for (iovcnt = 0; buffer && !buffer->file && iovcnt < LIBHTTPD_IOV_MAX; iovcnt++) {
+                iov[iovcnt].iov_base = buffer->data+pos;
+                iov[iovcnt].iov_len = buffer->size-pos;
+                want += buffer->size-pos;
+                buffer = buffer->next;
+                pos = 0;
+            }
+            nwritten = writev(conn->fd, iov, iovcnt);
+        }
+        __DEBUG("__libhttpd_connection_write %d/%d", (int)nwritten, (int)want);
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        __httpd_written(conn, nwritten);
+        if (nwritten < want) break;
+    }
+    if (nwritten == -1) {
+        if (errno == EAGAIN) {
+            nwritten = 0;
+        } else {
+            __WARN("__libhttpd_connection_write error: %s", strerror(errno));
+            conn->close = 1;
+            __httpd_connection_free(conn);
+            return;
+        }
+    }
+    if (!conn->buffer.head) {
+        conn->buffer.tail = 0;
+        conn->buffer_pos = 0;
+        if (conn->close != 0 && conn->nqueued == 0) {
+            __httpd_connection_free(conn);
+            return;
+        }
+        if (conn->write_wait && !httpd->edge) {
+            aeDeleteFileEvent(httpd->el, conn->fd, AE_WRITABLE);
+        }
+        conn->write_wait = 0;
+    } else if (conn->wio.active) {
+        /* a file segment waited for the socket before. */
+        if (conn->write_wait) aeDeleteFileEvent(httpd->el, conn->fd, AE_WRITABLE);
+        conn->write_wait = 0;
+    } else if (!conn->write_wait) {
+        conn->write_wait = 1;
+        if (!httpd->edge
+            && aeCreateFileEvent(httpd->el, conn->fd, AE_WRITABLE, __httpd_write, conn) == AE_ERR) {
+            __WARN("aeCreateFileEvent error: %s", strerror(errno));
+            conn->close = 1;
+            __httpd_connection_free(conn);
+            return;
+        }
+    }
+    if (conn->throttled && conn->out_size <= httpd->low_watermark) __httpd_unthrottle(conn);
+}
+
+/* completion of the sendmsg queued by __httpd_connection_send. */
+static void
+__httpd_sent(aeEventLoop *el, aeIo *io, int res, char *data, int flags) {
+    struct libhttpd_connection *conn = (struct libhttpd_connection *)io->clientData;
+    UNUSED(el);
+    UNUSED(data);
+    UNUSED(flags);
+
+    __httpd_pool_put(&conn->httpd->data_pool[1], conn->send);
+    conn->send = 0;
+    if (conn->dead) {
+        __httpd_buffer_free(conn->buffer.head);
+        conn->buffer.head = conn->buffer.tail = 0;
+        __httpd_connection_put(conn);
+        return;
+    }
+    if (res < 0) {
+        __WARN("__httpd_sent error: %s", strerror(-res));
+        conn->close = 1;
+        __httpd_connection_free(conn);
+        return;
+    }
+    __DEBUG("__httpd_sent %d", res);
+    __httpd_written(conn, res);
+    __libhttpd_connection_write(conn);
+}
+
+const char *libhttpd_request_method(struct libhttpd_request *req) {
+    return http_method_str(req->method);
+}
+
+const char *libhttpd_request_url(struct libhttpd_request *req) {
+    return req->url;
+}
+
+static const char *
+__httpd_field_value(struct libhttpd_request *req, int i) {
+    struct libhttpd_field *field = &req->fields[i];
+
+    return field->value.off == -1 ? "" : req->in->data+field->value.off;
+}
+
+const char *libhttpd_request_header_id(struct libhttpd_request *req, int id) {
+    if (id < 0 || id >= LIBHTTPD_HEADER_COUNT || !req->known[id]) return 0;
+    return __httpd_field_value(req, req->known[id]-1);
+}
+
+const char *libhttpd_request_header(struct libhttpd_request *req, const char *field) {
+    unsigned h;
+    int id, i;
+
+    if ((id = __httpd_header_known(field, (int)strlen(field))) != -1) {
+        return libhttpd_request_header_id(req, id);
+    }
+    if (!req->other) return 0;
+    h = __httpd_header_hash(field) & req->other_mask;
+    while ((i = req->other[h])) {
+        if (0 == strcasecmp(req->in->data+req->fields[i-1].name.off, field)) {
+            return __httpd_field_value(req, i-1);
+        }
+        h = (h+1) & req->other_mask;
+    }
+    return 0;
+}
+
+const char *libhttpd_request_body(struct libhttpd_request *req, int *size) {
+    *size = req->body_size;
+    return req->body;
+}
+
+void libhttpd_request_stream(struct libhttpd_request *req, libhttpd_data_cb cb, void *ctx) {
+    req->data_cb = cb;
+    req->data_ctx = ctx;
+}
+
+int64_t libhttpd_request_now(struct libhttpd_request *req) {
+    return aeGetMonotonicTime(req->conn->httpd->el);
+}
+
+void *libhttpd_request_alloc(struct libhttpd_request *req, int size) {
+    if (size < 0) return 0;
+    return __httpd_arena_alloc(req->arena, (size_t)size);
+}
+
+
+void libhttpd_response_header(struct libhttpd_response *res, const char *field, const char *value) {
+    struct libhttpd_header *header;
+
+    if (!field) return;
+    header = res->header.head;
+    while (header) {
+        if (0 == strcasecmp(header->field, field)) {
+            header->value = value ? __httpd_arena_strdup(res->arena, value) : 0;
+            __DEBUG("libhttpd_response_header set header %s:%s", field, value);
+            return;
+        }
+        header = header->next;
+    }
+
+    if (!value) return;
+    header = (struct libhttpd_header *)__httpd_arena_alloc(res->arena, sizeof *header);
+    header->next = 0;
+    header->field = __httpd_arena_strdup(res->arena, field);
+    header->value = __httpd_arena_strdup(res->arena, value);
+    if (res->header.head == 0) {
+        res->header.head = res->header.tail = header;
+    } else {
+        res->header.tail->next = header;
+        res->header.tail = header;
+    }
+    __DEBUG("libhttpd_response_header add header %s:%s", field, value);
+}
+
+/* an output node from the pool of httpd, or the heap when 0. */
+static struct libhttpd_buffer *
+__httpd_buffer_node(struct libhttpd *httpd) {
+    struct libhttpd_buffer *buffer;
+
+    if (httpd) {
+        buffer = (struct libhttpd_buffer *)__httpd_pool_get(httpd, &httpd->buffer_pool);
+        memset(buffer, 0, sizeof *buffer);
+        buffer->pool = &httpd->buffer_pool;
+    } else {
+        buffer = (struct libhttpd_buffer *)libhttpd_malloc(sizeof *buffer);
+        memset(buffer, 0, sizeof *buffer);
+    }
+    return buffer;
+}
+
+static struct libhttpd_buffer *
+__httpd_buffer_new(struct libhttpd *httpd, const char *data, int size) {
+    struct libhttpd_buffer *buffer;
+    int i;
+
+    buffer = __httpd_buffer_node(httpd);
+    for (i = 0; httpd && i < LIBHTTPD_DATA_CLASSES; i++) {
+        if (size <= g_data_class[i]) {
+            buffer->data_pool = &httpd->data_pool[i];
+            buffer->data = __httpd_pool_get(httpd, buffer->data_pool);
+            break;
+        }
+    }
+    if (!buffer->data) buffer->data = libhttpd_malloc(size);
+    memcpy(buffer->data, data, size);
+    buffer->size = size;
+    return buffer;
+}
+
+/* queue the chain head..tail behind any earlier pipelined response. */
+static void
+__httpd_connection_append(struct libhttpd_connection *conn, struct libhttpd_buffer *head,
+                          struct libhttpd_buffer *tail) {
+    /* a deferred response finishing after its connection went away. */
+    if (conn->dead) {
+        __httpd_buffer_free(head);
+        return;
+    }
+    if (conn->buffer.head == 0) {
+        conn->buffer.head = head;
+    } else {
+        conn->buffer.tail->next = head;
+    }
+    conn->buffer.tail = tail;
+}
+
+/* output of res goes out once every earlier response on the connection
+ * ended, until then it is held on res. */
+static void
+__httpd_response_output(struct libhttpd_response *res, struct libhttpd_buffer *head,
+                        struct libhttpd_buffer *tail) {
+    struct libhttpd_connection *conn = res->conn;
+    struct libhttpd *httpd = conn->httpd;
+
+    if (res->orphan) {
+        __httpd_buffer_free(head);
+        return;
+    }
+    /* past the high watermark stop taking requests, producers check
+     * libhttpd_response_writable. */
+    __httpd_out(conn, __httpd_chain_size(head));
+    if (!conn->throttled && httpd->high_watermark > 0 && conn->out_size > httpd->high_watermark) {
+        __atomic_store_n(&conn->throttled, 1, __ATOMIC_RELAXED);
+        if (!httpd->edge) __httpd_input_stop(conn);
+        __DEBUG("__httpd_response_output throttled at %lld", conn->out_size);
+    }
+    if (conn->queue.head == res) {
+        __httpd_connection_append(conn, head, tail);
+        return;
+    }
+    if (res->held.head == 0) {
+        res->held.head = head;
+    } else {
+        res->held.tail->next = head;
+    }
+    res->held.tail = tail;
+}
+
+static void
+__httpd_response_chunk(struct libhttpd_response *res, struct libhttpd_buffer *head,
+                       struct libhttpd_buffer *tail, long long size) {
+    struct libhttpd_buffer *line, *crlf;
+    char buff[32];
+
+    line = __httpd_buffer_new(__httpd_local(res), buff, snprintf(buff, sizeof(buff), "%llx\r\n", size));
+    crlf = __httpd_buffer_new(__httpd_local(res), "\r\n", 2);
+    line->next = head;
+    tail->next = crlf;
+    __httpd_response_output(res, line, crlf);
+}
+
+static void
+__httpd_notify_signal(struct libhttpd *httpd);
+
+/* a deferred response written from a thread other than its loop's: queue the
+ * call on the response and mail it to the loop, which replays it in order.
+ * Once mailed the loop stages too, until the mail is applied. Returns 1 if
+ * staged, 0 if the caller may act on the connection directly. */
+static int
+__httpd_response_stage(struct libhttpd_response *res, struct libhttpd_buffer *buffer,
+                       int call, int status) {
+    struct libhttpd *httpd;
+    int mail;
+
+    if (!res->deferred) return 0;
+    httpd = res->conn->httpd;
+
+    pthread_mutex_lock(&httpd->mailbox_lock);
+    if (t_httpd == httpd && !res->mailed) {
+        pthread_mutex_unlock(&httpd->mailbox_lock);
+        return 0;
+    }
+    if (buffer) {
+        if (res->staged.head == 0) {
+            res->staged.head = res->staged.tail = buffer;
+        } else {
+            res->staged.tail->next = buffer;
+            res->staged.tail = buffer;
+        }
+    }
+    /* a status may be anything, 0 included, pending says there was a call. */
+    if (call == LIBHTTPD_STAGE_BEGIN) {
+        res->begin_pending = 1;
+        res->begin_status = status;
+    } else if (call == LIBHTTPD_STAGE_END) {
+        res->end_pending = 1;
+        res->end_status = status;
+    }
+    mail = !res->mailed;
+    if (mail) {
+        res->mailed = 1;
+        res->mail_next = httpd->mailbox;
+        httpd->mailbox = res;
+    }
+    pthread_mutex_unlock(&httpd->mailbox_lock);
+
+    if (mail) __httpd_notify_signal(httpd);
+    return 1;
+}
+
+static void
+__httpd_response_append(struct libhttpd_response *res, struct libhttpd_buffer *buffer) {
+    struct libhttpd_connection *conn = res->conn;
+
+    if (__httpd_response_stage(res, buffer, LIBHTTPD_STAGE_WRITE, 0)) return;
+    res->body_size += buffer->size;
+    if (!res->begun) {
+        /* held until end even for HEAD, it only counts for Content-Length
+         * then, but the data libhttpd_response_write returned stays valid. */
+        if (res->body.head == 0) {
+            res->body.head = res->body.tail = buffer;
+        } else {
+            res->body.tail->next = buffer;
+            res->body.tail = buffer;
+        }
+        return;
+    }
+
+    /* an empty chunk would end the body, HEAD has no body. */
+    if (buffer->size == 0 || res->req->method == HTTP_HEAD) {
+        __httpd_buffer_release(buffer);
+        return;
+    }
+    if (res->chunked) {
+        __httpd_response_chunk(res, buffer, buffer, buffer->size);
+    } else {
+        __httpd_response_output(res, buffer, buffer);
+    }
+    /* streamed output goes out as it is produced, unless the socket is
+     * already full and the writable handler will pick it up. */
+    if (conn->queue.head == res && !conn->write_wait) __libhttpd_connection_write(conn);
+}
+
+static void
+__httpd_response_file(struct libhttpd_response *res, int fd, off_t offset, off_t length,
+                      libhttpd_free_cb free_cb, void *ctx) {
+    struct libhttpd_buffer *buffer;
+    struct stat st;
+    off_t size;
+
+    if (length < 0) {
+        length = 0;
+        if (fstat(fd, &st) == 0 && st.st_size > offset) length = st.st_size-offset;
+    }
+    if (length == 0) {
+        if (free_cb) free_cb(ctx);
+        else close(fd);
+        return;
+    }
+
+    /* segments fit the int sized output buffers, the last one owns fd. */
+    do {
+        size = length > LIBHTTPD_FILE_SEGMENT ? LIBHTTPD_FILE_SEGMENT : length;
+        buffer = __httpd_buffer_node(__httpd_local(res));
+        buffer->file = 1;
+        buffer->fd = fd;
+        buffer->offset = offset;
+        buffer->size = (int)size;
+        offset += size;
+        length -= size;
+        if (length > 0) {
+            buffer->free_cb = __httpd_free_none;
+        } else {
+            buffer->free_cb = free_cb;
+            buffer->ctx = ctx;
+        }
+        __httpd_response_append(res, buffer);
+    } while (length > 0);
+    __DEBUG("libhttpd_response_sendfile fd:%d", fd);
+}
+
+void libhttpd_response_sendfile(struct libhttpd_response *res, int fd, off_t offset, off_t length) {
+    __httpd_response_file(res, fd, offset, length, 0, 0);
+}
+
+void libhttpd_response_sendfile_ref(struct libhttpd_response *res, int fd, off_t offset, off_t length,
+                                    libhttpd_free_cb free_cb, void *ctx) {
+    __httpd_response_file(res, fd, offset, length, free_cb ? free_cb : __httpd_free_none, ctx);
+}
+
+char *libhttpd_response_write(struct libhttpd_response *res, const char *data, int size) {
+    struct libhttpd_buffer *buffer;
+    char *copy;
+
+    /* off the loop the buffer may be written and freed before append returns. */
+    buffer = __httpd_buffer_new(__httpd_local(res), data, size);
+    copy = buffer->data;
+    __httpd_response_append(res, buffer);
+    __DEBUG("libhttpd_response_write size:%d", size);
+
+    return copy;
+}
+
+void libhttpd_response_write_ref(struct libhttpd_response *res, const char *data, int size,
+                                 libhttpd_free_cb free_cb, void *ctx) {
+    struct libhttpd_buffer *buffer;
+
+    buffer = __httpd_buffer_node(__httpd_local(res));
+    buffer->data = (char *)data;
+    buffer->size = size;
+    buffer->free_cb = free_cb;
+    buffer->ctx = ctx;
+    /* never hand caller memory to free(). */
+    if (!buffer->free_cb) buffer->free_cb = __httpd_free_none;
+
+    __httpd_response_append(res, buffer);
+    __DEBUG("libhttpd_response_write_ref size:%d", size);
+}
+
+static void
+__httpd_shared_release(void *ctx) {
+    libhttpd_shared_release((struct libhttpd_shared *)ctx);
+}
+
+void libhttpd_response_write_shared(struct libhttpd_response *res, struct libhttpd_shared *shared,
+                                    int offset, int size) {
+    if (offset < 0 || offset > shared->size) offset = shared->size;
+    if (size < 0 || size > shared->size-offset) size = shared->size-offset;
+
+    libhttpd_shared_retain(shared);
+    libhttpd_response_write_ref(res, shared->data+offset, size, __httpd_shared_release, shared);
+}
+
+struct libhttpd_shared *libhttpd_shared_new(const char *data, int size) {
+    struct libhttpd_shared *shared;
+
+    /* header and payload in one allocation, released as one. */
+    shared = (struct libhttpd_shared *)libhttpd_malloc(sizeof *shared + size);
+    memset(shared, 0, sizeof *shared);
+    shared->data = (char *)(shared+1);
+    shared->size = size;
+    shared->ref = 1;
+    if (data) memcpy(shared->data, data, size);
+    return shared;
+}
+
+struct libhttpd_shared *libhttpd_shared_wrap(char *data, int size, libhttpd_free_cb free_cb, void *ctx) {
+    struct libhttpd_shared *shared;
+
+    shared = (struct libhttpd_shared *)libhttpd_malloc(sizeof *shared);
+    memset(shared, 0, sizeof *shared);
+    shared->data = data;
+    shared->size = size;
+    shared->ref = 1;
+    shared->free_cb = free_cb;
+    shared->ctx = ctx;
+    return shared;
+}
+
+char *libhttpd_shared_data(struct libhttpd_shared *shared) {
+    return shared->data;
+}
+
+int libhttpd_shared_size(struct libhttpd_shared *shared) {
+    return shared->size;
+}
+
+void libhttpd_shared_retain(struct libhttpd_shared *shared) {
+    __atomic_add_fetch(&shared->ref, 1, __ATOMIC_RELAXED);
+}
+
+void libhttpd_shared_release(struct libhttpd_shared *shared) {
+    if (__atomic_sub_fetch(&shared->ref, 1, __ATOMIC_ACQ_REL) != 0) return;
+    if (shared->free_cb) shared->free_cb(shared->ctx);
+    libhttpd_free(shared);
+}
+
+/* status line and headers, framed by content length or chunked encoding. */
+static struct libhttpd_buffer *
+__httpd_response_head(struct libhttpd_response *res, int status) {
+    struct libhttpd_connection *conn;
+    struct libhttpd_header *header;
+    int size, date = 0, connection = 0;
+    char buff[LIBHTTPD_RES_HEADER_LEN];
+    int buff_size = LIBHTTPD_RES_HEADER_LEN;
+
+    conn = res->conn;
+    size = snprintf(buff, buff_size, "HTTP/1.1 %s\r\n", http_status_str(status));
+
+    /* HTTP/1.0 has no chunked encoding, the body ends with the connection. */
+    if (res->begun && !res->chunked) res->close = 1;
+
+    header = res->header.head;
+    while (header) {
+        if (header->value) {
+            size += snprintf(buff+size, buff_size-size, "%s: %s\r\n", header->field, header->value);
+            if (0 == strcasecmp(header->field, "Date")) date = 1;
+            if (0 == strcasecmp(header->field, "Connection")) {
+                connection = 1;
+                if (0 == strcasecmp(header->value, "close")) res->close = 1;
+            }
+        }
+        header = header->next;
+    }
+    if (!date) {
+        size += snprintf(buff+size, buff_size-size, "Date: %s\r\n", __httpd_date(conn->httpd));
+    }
+    if (!connection && res->close) {
+        size += snprintf(buff+size, buff_size-size, "Connection: close\r\n");
+    } else if (!connection && res->req->http_major == 1 && res->req->http_minor == 0) {
+        /* HTTP/1.0 closes by default, confirm the keep-alive it asked for. */
+        size += snprintf(buff+size, buff_size-size, "Connection: keep-alive\r\n");
+    }
+    if (!res->begun) {
+        size += snprintf(buff+size, buff_size-size, "Content-Length: %lld\r\n\r\n", res->body_size);
+    } else if (res->chunked) {
+        size += snprintf(buff+size, buff_size-size, "Transfer-Encoding: chunked\r\n\r\n");
+    } else {
+        size += snprintf(buff+size, buff_size-size, "\r\n");
+    }
+    if (size >= buff_size) size = buff_size-1;
+
+    return __httpd_buffer_new(__httpd_local(res), buff, size);
+}
+
+void libhttpd_response_begin(struct libhttpd_response *res, int status) {
+    struct libhttpd_connection *conn;
+    struct libhttpd_buffer *buffer;
+
+    if (res->ended || res->begun) {
+        __WARN("libhttpd_response_begin after the response started");
+        return;
+    }
+    if (__httpd_response_stage(res, 0, LIBHTTPD_STAGE_BEGIN, status)) return;
+    conn = res->conn;
+    res->begun = 1;
+    res->chunked = res->req->http_major > 1
+                   || (res->req->http_major == 1 && res->req->http_minor >= 1);
+
+    buffer = __httpd_response_head(res, status);
+    __httpd_response_output(res, buffer, buffer);
+
+    /* whatever was written before begin becomes the first chunk. */
+    if (res->body.head && res->req->method == HTTP_HEAD) {
+        __httpd_buffer_free(res->body.head);
+        res->body.head = res->body.tail = 0;
+    } else if (res->body.head) {
+        if (res->chunked) {
+            __httpd_response_chunk(res, res->body.head, res->body.tail, res->body_size);
+        } else {
+            __httpd_response_output(res, res->body.head, res->body.tail);
+        }
+        res->body.head = res->body.tail = 0;
+    }
+
+    if (conn->queue.head == res && !conn->write_wait) __libhttpd_connection_write(conn);
+    __DEBUG("libhttpd_response_begin %s", http_status_str(status));
+}
+
+/* release the responses at the head of the queue that are done, handing the
+ * connection to the next one along with the output it held back. */
+static void
+__httpd_pipeline_next(struct libhttpd_connection *conn) {
+    struct libhttpd_response *res;
+
+    while ((res = conn->queue.head) && res->ended && res->complete) {
+        __httpd_pipeline_del(conn, res);
+        /* nothing goes out after a response that closes the connection. */
+        if (res->close) {
+            conn->close = 1;
+            __httpd_pipeline_drop(conn);
+        }
+        __httpd_message_free(res);
+        if ((res = conn->queue.head) && res->held.head) {
+            __httpd_connection_append(conn, res->held.head, res->held.tail);
+            res->held.head = res->held.tail = 0;
+        }
+    }
+    if (conn->paused) __httpd_input_resume(conn);
+}
+
+void libhttpd_response_end(struct libhttpd_response *res, int status) {
+    struct libhttpd_connection *conn;
+    struct libhttpd_buffer *buffer;
+
+    if (res->ended) {
+        __WARN("libhttpd_response_end called twice");
+        return;
+    }
+    if (__httpd_response_stage(res, 0, LIBHTTPD_STAGE_END, status)) return;
+    res->ended = 1;
+    conn = res->conn;
+
+    if (res->begun) {
+        if (res->chunked && res->req->method != HTTP_HEAD) {
+            buffer = __httpd_buffer_new(__httpd_local(res), "0\r\n\r\n", 5);
+            __httpd_response_output(res, buffer, buffer);
+        }
+    } else {
+        /* queue headers and body behind any earlier pipelined response, the
+         * socket write happens once per loop pass in beforesleep. A HEAD
+         * response sends the headers of the body alone. */
+        buffer = __httpd_response_head(res, status);
+        if (res->req->method == HTTP_HEAD) {
+            __httpd_buffer_free(res->body.head);
+            res->body.head = res->body.tail = 0;
+        }
+        buffer->next = res->body.head;
+        __httpd_response_output(res, buffer, res->body.tail ? res->body.tail : buffer);
+        res->body.head = res->body.tail = 0;
+    }
+    __DEBUG("libhttpd_response_end %s", http_status_str(status));
+
+    /* a deferred response outliving its place on the connection. */
+    if (res->orphan) {
+        __httpd_message_free(res);
+        if (--conn->norphan == 0 && conn->dead) __httpd_connection_put(conn);
+        return;
+    }
+    __httpd_pipeline_next(conn);
+    if (!conn->write_wait) __httpd_flush_add(conn);
+}
+
+void libhttpd_response_defer(struct libhttpd_response *res) {
+    res->deferred = 1;
+}
+
+int libhttpd_response_writable(struct libhttpd_response *res) {
+    return res->orphan || !__atomic_load_n(&res->conn->throttled, __ATOMIC_RELAXED);
+}
+
+void libhttpd_response_on_drain(struct libhttpd_response *res, libhttpd_drain_cb cb, void *ctx) {
+    if (libhttpd_response_writable(res)) {
+        cb(ctx, res);
+        return;
+    }
+    res->drain_cb = cb;
+    res->drain_ctx = ctx;
+}
+
+/* replay the calls other threads staged on a deferred response. */
+static void
+__httpd_response_apply(struct libhttpd_response *res) {
+    struct libhttpd *httpd = res->conn->httpd;
+    struct libhttpd_buffer *buffer, *next;
+    int begin, begin_status, end, end_status;
+
+    pthread_mutex_lock(&httpd->mailbox_lock);
+    buffer = res->staged.head;
+    begin = res->begin_pending;
+    begin_status = res->begin_status;
+    end = res->end_pending;
+    end_status = res->end_status;
+    res->staged.head = res->staged.tail = 0;
+    res->begin_pending = res->end_pending = 0;
+    res->mailed = 0;
+    pthread_mutex_unlock(&httpd->mailbox_lock);
+
+    if (begin) libhttpd_response_begin(res, begin_status);
+    while (buffer) {
+        next = buffer->next;
+        buffer->next = 0;
+        __httpd_response_append(res, buffer);
+        buffer = next;
+    }
+    if (end) libhttpd_response_end(res, end_status);
+}
+
+static void
+__httpd_mailbox(struct libhttpd *httpd) {
+    struct libhttpd_response *res, *next, *list = 0;
+
+    pthread_mutex_lock(&httpd->mailbox_lock);
+    res = httpd->mailbox;
+    httpd->mailbox = 0;
+    pthread_mutex_unlock(&httpd->mailbox_lock);
+
+    /* mailed newest first, apply in the order they arrived. */
+    while (res) {
+        next = res->mail_next;
+        res->mail_next = list;
+        list = res;
+        res = next;
+    }
+    while ((res = list)) {
+        list = res->mail_next;
+        res->mail_next = 0;
+        __httpd_response_apply(res);
+    }
+}
+
+
+static int
+__httpd_on_message_begin(http_parser *p) {
+    struct libhttpd_connection *conn;
     struct libhttpd_request *req;
     struct libhttpd_response *res;
+    struct libhttpd_arena *arena;
 
     conn = (struct libhttpd_connection *)p->data;
-    req = (struct libhttpd_request *)malloc(sizeof *req);
+    arena = __httpd_arena_new(conn);
+    req = (struct libhttpd_request *)__httpd_arena_alloc(arena, sizeof *req);
     memset(req, 0, sizeof *req);
-    res = (struct libhttpd_response *)malloc(sizeof *res);
+    res = (struct libhttpd_response *)__httpd_arena_alloc(arena, sizeof *res);
     memset(res, 0, sizeof *res);
+    req->arena = res->arena = arena;
 
     conn->req = req;
     conn->res = res;
     req->conn = conn;
     res->conn = conn;
+    res->req = req;
+    __httpd_pipeline_add(conn, res);
+    req->start = aeGetMonotonicTime(conn->httpd->el);
+
+    req->in = conn->in;
+    req->in->ref++;
+    req->url_view.off = -1;
+    req->fields_cap = LIBHTTPD_REQ_FIELDS;
+    req->fields = __httpd_arena_alloc(arena, req->fields_cap * sizeof *req->fields);
 
     __DEBUG("__httpd_on_message_begin");
     return 0;
 }
 
+/* grow a view by the next piece of its token. Pieces are contiguous unless
+ * the parser skipped bytes in between (a folded header line), then the piece
+ * is moved down over the skipped bytes, which are parsed already. */
+static void
+__httpd_view_append(struct libhttpd_request *req, struct libhttpd_view *view, const char *at, size_t length) {
+    char *data = req->in->data;
+
+    /* an empty value is reported with no bytes, and at may point anywhere. */
+    if (length == 0) return;
+    if (view->off == -1) {
+        view->off = (int)(at - data);
+        view->len = (int)length;
+        return;
+    }
+    if (at != data+view->off+view->len) {
+        memmove(data+view->off+view->len, at, length);
+    }
+    view->len += (int)length;
+}
+
 static int
 __httpd_on_url(http_parser *p, const char *at, size_t length) {
     struct libhttpd_connection *conn;
@@ -437,7 +2000,7 @@ __httpd_on_url(http_parser *p, const char *at, size_t length) {
     conn = (struct libhttpd_connection *)p->data;
     req = conn->req;
 
-    req->url = strndup(at, length);
+    __httpd_view_append(req, &req->url_view, at, length);
 
     __DEBUG("__httpd_on_url %.*s", length, at);
     return 0;
@@ -454,41 +2017,140 @@ static int
 __httpd_on_header_field(http_parser *p, const char *at, size_t length) {
     struct libhttpd_connection *conn;
     struct libhttpd_request *req;
-    struct libhttpd_header *header;
+    struct libhttpd_field *field;
 
     conn = (struct libhttpd_connection *)p->data;
     req = conn->req;
-    header = (struct libhttpd_header *)malloc(sizeof *header);
-    memset(header, 0, sizeof *header);
-
-    header->field = strndup(at ,length);
-    if (req->header.head == 0) {
-        req->header.head = req->header.tail = header;
-    } else {
-        req->header.tail->next = header;
-        req->header.tail = header;
+    /* trailers of a chunked body are not kept, the views point into the
+     * head's input block, which is no longer the one being parsed. */
+    if (length == 0 || req->head_done) return 0;
+
+    /* a name split over reads arrives in pieces, a new field starts after a
+     * value. */
+    if (req->nfields == 0 || req->in_value) {
+        if (req->nfields == req->fields_cap) {
+            field = req->fields;
+            req->fields_cap *= 2;
+            req->fields = __httpd_arena_alloc(req->arena, req->fields_cap * sizeof *field);
+            memcpy(req->fields, field, req->nfields * sizeof *field);
+        }
+        field = &req->fields[req->nfields++];
+        field->name.off = field->value.off = -1;
+        field->name.len = field->value.len = 0;
+        req->in_value = 0;
     }
+    field = &req->fields[req->nfields-1];
+    __httpd_view_append(req, &field->name, at, length);
 
     __DEBUG("__httpd_on_header_field %.*s", length, at);
     return 0;
 }
 
 static int
-__httpd_on_header_value(http_parser *p, const char *at, size_t length) {
-    struct libhttpd_connection *conn;
-    struct libhttpd_request *req;
-    struct libhttpd_header *header;
-
-    conn = (struct libhttpd_connection *)p->data;
-    req = conn->req;
-    header = req->header.tail;
-
-    header->value = strndup(at, length);
-    if (0 == strcasecmp(header->field, "Content-Length")) {
-        req->content_length = atoi(header->value);
+__httpd_on_header_value(http_parser *p, const char *at, size_t length) {
+    struct libhttpd_connection *conn;
+    struct libhttpd_request *req;
+
+    conn = (struct libhttpd_connection *)p->data;
+    req = conn->req;
+    if (req->head_done) return 0;
+
+    __httpd_view_append(req, &req->fields[req->nfields-1].value, at, length);
+    req->in_value = 1;
+
+    __DEBUG("__httpd_on_header_value %.*s", length, at);
+    return 0;
+}
+
+/* index the headers for lookups, the first of the same name wins. The
+ * table of other headers is sized to stay at most half full. */
+static void
+__httpd_request_index(struct libhttpd_request *req) {
+    struct libhttpd_field *field;
+    const char *name;
+    unsigned size, h;
+    int i, id, j;
+
+    for (i = 0; i < req->nfields; i++) {
+        field = &req->fields[i];
+        name = req->in->data+field->name.off;
+        if ((id = __httpd_header_known(name, field->name.len)) != -1) {
+            if (!req->known[id]) req->known[id] = i+1;
+            continue;
+        }
+        if (!req->other) {
+            for (size = 8; size < (unsigned)req->nfields*2; size <<= 1);
+            req->other = __httpd_arena_alloc(req->arena, size * sizeof(int));
+            memset(req->other, 0, size * sizeof(int));
+            req->other_mask = size-1;
+        }
+        h = __httpd_header_hash(name) & req->other_mask;
+        while ((j = req->other[h])) {
+            if (0 == strcasecmp(req->in->data+req->fields[j-1].name.off, name)) break;
+            h = (h+1) & req->other_mask;
+        }
+        if (!j) req->other[h] = i+1;
+    }
+}
+
+/* the head is parsed and its bytes are no longer needed by the parser,
+ * terminate the views in place. */
+static void
+__httpd_request_terminate(struct libhttpd_request *req) {
+    char *data = req->in->data;
+    int i;
+
+    if (req->url_view.off == -1) {
+        req->url = "";
+    } else {
+        req->url = data+req->url_view.off;
+        req->url[req->url_view.len] = '\0';
+    }
+    for (i = 0; i < req->nfields; i++) {
+        struct libhttpd_field *field = &req->fields[i];
+        data[field->name.off+field->name.len] = '\0';
+        if (field->value.off != -1) {
+            data[field->value.off+field->value.len] = '\0';
+        }
+    }
+    req->head_done = 1;
+    __httpd_request_index(req);
+}
+
+/* answer the request in place of the user callback and stop reading, the
+ * connection closes once the response is out. */
+static void
+__httpd_response_error(struct libhttpd_connection *conn, int status) {
+    const char *reason = http_status_str(status);
+
+    conn->req->discard = 1;
+    if (conn->res->ended) return;
+    libhttpd_response_header(conn->res, "Connection", "close");
+    libhttpd_response_write(conn->res, reason, strlen(reason));
+    libhttpd_response_end(conn->res, status);
+    conn->close = 1;
+}
+
+/* answer 413 when buffering size more bytes of body would take conn over
+ * its memory cap, 503 when it would take all connections over the global
+ * one. */
+static int
+__httpd_mem_admit(struct libhttpd_connection *conn, long long size) {
+    struct libhttpd *httpd = conn->httpd;
+    long long total;
+
+    if (httpd->conn_mem_max > 0 && conn->mem + size > httpd->conn_mem_max) {
+        __WARN("body of %lld bytes over the connection memory cap, holding %lld of %lld",
+               size, conn->mem, httpd->conn_mem_max);
+        __httpd_response_error(conn, 413);
+        return -1;
+    }
+    if (g_mem_max > 0 && (total = libhttpd_memory_used()) + size > g_mem_max) {
+        __WARN("body of %lld bytes over the memory cap, holding %lld of %lld",
+               size, total, g_mem_max);
+        __httpd_response_error(conn, 503);
+        return -1;
     }
-
-    __DEBUG("__httpd_on_header_value %.*s", length, at);
     return 0;
 }
 
@@ -496,19 +2158,87 @@ static int
 __httpd_on_headers_complete(http_parser *p) {
     struct libhttpd_connection *conn;
     struct libhttpd_request *req;
+    struct libhttpd *httpd;
 
     conn = (struct libhttpd_connection *)p->data;
     req = conn->req;
+    httpd = conn->httpd;
+
+    /* kept on the request, the parser moves on once a response is deferred. */
+    req->method = p->method;
+    req->http_major = p->http_major;
+    req->http_minor = p->http_minor;
+    /* content_length of the parser is ULLONG_MAX when absent. */
+    if (p->content_length != ULLONG_MAX && p->content_length <= INT_MAX) {
+        req->content_length = (int)p->content_length;
+    }
+    __httpd_request_terminate(req);
+
+    /* Connection: close, HTTP/1.0 without keep-alive, or the last request
+     * this connection may serve. */
+    conn->nrequests++;
+    if (!http_should_keep_alive(p)
+        || (httpd->max_requests > 0 && conn->nrequests >= httpd->max_requests)) {
+        conn->res->close = 1;
+    }
+
+    /* lets the handler stream the body, or answer before it arrives. */
+    if (httpd->headers_cb) {
+        httpd->headers_cb(httpd->ud, req, conn->res);
+        if (conn->res->ended) req->discard = 1;
+    }
+    if (req->discard || req->data_cb) {
+        __DEBUG("__httpd_on_headers_complete");
+        return 0;
+    }
 
+    if (p->content_length != ULLONG_MAX && httpd->max_body > 0
+        && p->content_length > (unsigned long long)httpd->max_body) {
+        __WARN("__httpd_on_headers_complete body %llu over max %lld",
+               (unsigned long long)p->content_length, httpd->max_body);
+        __httpd_response_error(conn, 413);
+        return 0;
+    }
+    /* a chunked body has no length up front, it grows in __httpd_on_body. */
     if (req->content_length > 0) {
-        req->body = malloc(req->content_length);
-        memset(req->body, 0, req->content_length);
+        if (__httpd_mem_admit(conn, req->content_length) != 0) return 0;
+        __httpd_mem(conn, req->content_length);
+        req->body = libhttpd_malloc(req->content_length);
+        req->body_cap = req->content_length;
     }
 
     __DEBUG("__httpd_on_headers_complete");
     return 0;
 }
 
+/* grow a chunked body geometrically, answering 413 past max_body. */
+static int
+__httpd_body_grow(struct libhttpd_connection *conn, struct libhttpd_request *req, size_t length) {
+    long long need, cap, max;
+
+    max = conn->httpd->max_body > 0 ? conn->httpd->max_body : INT_MAX;
+    need = (long long)req->body_size + length;
+    cap = req->body_cap ? req->body_cap : LIBHTTPD_BODY_INIT;
+    while (cap < need) cap *= 2;
+    if (cap > max) cap = max;
+    if (need > max || __httpd_mem_admit(conn, cap - req->body_cap) != 0) {
+        if (need > max) {
+            __WARN("__httpd_on_body chunked body over max %lld", max);
+            __httpd_response_error(conn, 413);
+        }
+        __httpd_mem(conn, -req->body_cap);
+        libhttpd_free(req->body);
+        req->body = 0;
+        req->body_size = req->body_cap = 0;
+        return -1;
+    }
+
+    __httpd_mem(conn, cap - req->body_cap);
+    req->body = libhttpd_realloc(req->body, cap);
+    req->body_cap = (int)cap;
+    return 0;
+}
+
 static int
 __httpd_on_body(http_parser *p, const char *at, size_t length) {
     struct libhttpd_connection *conn;
@@ -517,9 +2247,19 @@ __httpd_on_body(http_parser *p, const char *at, size_t length) {
     conn = (struct libhttpd_connection *)p->data;
     req = conn->req;
 
-    if (req->body && req->body_size < req->content_length) {
-        if (req->content_length - req->body_size < length) {
-            length = req->content_length - req->body_size;
+    if (req->discard) return 0;
+    if (req->data_cb) {
+        if (req->data_cb(req->data_ctx, req, at, (int)length) != 0) {
+            __httpd_response_error(conn, 400);
+        }
+        return 0;
+    }
+    if (req->content_length <= 0 && length > (size_t)(req->body_cap - req->body_size)) {
+        if (__httpd_body_grow(conn, req, length) != 0) return 0;
+    }
+    if (req->body && req->body_size < req->body_cap) {
+        if ((size_t)(req->body_cap - req->body_size) < length) {
+            length = req->body_cap - req->body_size;
             __WARN("__httpd_on_body content_length:%d body_size:%d length:%u",
                    req->content_length, req->body_size, length);
         }
@@ -531,6 +2271,40 @@ __httpd_on_body(http_parser *p, const char *at, size_t length) {
     return 0;
 }
 
+/* the parser is done with the current request, its response stays queued
+ * until it ended and every earlier one is out. */
+static void
+__httpd_message_done(struct libhttpd_connection *conn) {
+    struct libhttpd_response *res = conn->res;
+
+    conn->req = 0;
+    conn->res = 0;
+    res->complete = 1;
+    if (!res->ended && !res->deferred) {
+        __WARN("response neither ended nor deferred by the callback");
+        libhttpd_response_end(res, 500);
+        return;
+    }
+    __httpd_pipeline_next(conn);
+}
+
+/* nothing more will be parsed on the connection: finish the request cut
+ * short, unless it already has an answer coming. */
+static void
+__httpd_message_abort(struct libhttpd_connection *conn) {
+    struct libhttpd_response *res = conn->res;
+
+    if (!res) return;
+    if (res->ended || res->deferred) {
+        __httpd_message_done(conn);
+        return;
+    }
+    conn->req = 0;
+    conn->res = 0;
+    __httpd_pipeline_del(conn, res);
+    __httpd_message_free(res);
+}
+
 static int
 __httpd_on_message_complete(http_parser *p) {
     struct libhttpd_connection *conn;
@@ -543,84 +2317,608 @@ __httpd_on_message_complete(http_parser *p) {
     res = conn->res;
     httpd = conn->httpd;
 
-    httpd->cb(httpd->ud, req, res);
+    if (!res->ended && !req->discard) httpd->cb(httpd->ud, req, res);
+    __DEBUG("__httpd_on_message_complete %s %s %lldms", http_method_str(req->method),
+            req->url, aeGetMonotonicTime(httpd->el) - req->start);
+
+    /* nothing after a closing request is parsed. With enough responses
+     * pending, or enough output queued, wait for them before parsing the
+     * rest of what was read. */
+    if (res->close) conn->last = 1;
+    __httpd_message_done(conn);
+    if (conn->last || conn->nqueued >= LIBHTTPD_PIPELINE_MAX || conn->throttled) {
+        conn->paused = 1;
+        http_parser_pause(p, 1);
+    }
+    return 0;
+}
+
+static http_parser_settings g_settings = {
+    .on_message_begin = __httpd_on_message_begin,
+    .on_url = __httpd_on_url,
+    .on_status = __httpd_on_status,
+    .on_header_field = __httpd_on_header_field,
+    .on_header_value = __httpd_on_header_value,
+    .on_headers_complete = __httpd_on_headers_complete,
+    .on_body = __httpd_on_body,
+    .on_message_complete = __httpd_on_message_complete
+};
 
-    __httpd_request_free(req);
-    __httpd_response_free(res);
-    conn->req = 0;
-    conn->res = 0;
+/* make room to read into conn->in. The block is reused from where parsing
+ * left off; a full one is compacted when nothing else points into it, or
+ * else the bytes still needed, with a request head in progress, are carried
+ * over to a new block and the old one lives on until its requests are
+ * freed. */
+static void
+__httpd_input_reserve(struct libhttpd_connection *conn) {
+    struct libhttpd *httpd = conn->httpd;
+    struct libhttpd_input *in = conn->in, *fresh;
+    struct libhttpd_request *req = conn->req;
+    int keep, cap, i;
+
+    if (!in) {
+        conn->in = __httpd_input_new(httpd, LIBHTTPD_INPUT_LEN);
+        return;
+    }
+    if (req && req->head_done) req = 0;
+    keep = in->pos;
+    if (req && req->url_view.off != -1) keep = req->url_view.off;
+
+    if (in->ref == 1 && keep == in->size) in->pos = in->size = 0;
+    if (in->cap - in->size >= LIBHTTPD_READ_MIN) return;
+
+    if (in->ref == 1) {
+        memmove(in->data, in->data+in->pos, in->size-in->pos);
+        in->size -= in->pos;
+        in->pos = 0;
+        if (in->cap - in->size < LIBHTTPD_READ_MIN) {
+            in = libhttpd_realloc(in, sizeof *in + in->cap*2);
+            in->cap *= 2;
+            conn->in = in;
+        }
+        return;
+    }
+
+    cap = LIBHTTPD_INPUT_LEN;
+    while (cap - (in->size-keep) < LIBHTTPD_READ_MIN) cap *= 2;
+    fresh = __httpd_input_new(httpd, cap);
+    memcpy(fresh->data, in->data+keep, in->size-keep);
+    fresh->size = in->size-keep;
+    fresh->pos = in->pos-keep;
+    if (req) {
+        if (req->url_view.off != -1) req->url_view.off -= keep;
+        for (i = 0; i < req->nfields; i++) {
+            struct libhttpd_field *field = &req->fields[i];
+            if (field->name.off != -1) field->name.off -= keep;
+            if (field->value.off != -1) field->value.off -= keep;
+        }
+        __httpd_input_unref(httpd, req->in);
+        req->in = fresh;
+        fresh->ref++;
+    }
+    __httpd_input_unref(httpd, in);
+    conn->in = fresh;
+}
 
-    __DEBUG("__httpd_on_message_complete");
+/* feed the unparsed part of conn->in to the parser. Returns 1 when it
+ * paused, the rest stays in conn->in until parsing resumes, -1 on a parse
+ * error. */
+static int
+__httpd_connection_parse(struct libhttpd_connection *conn) {
+    struct libhttpd_input *in = conn->in;
+    int parsed, size;
+
+    size = in->size - in->pos;
+    parsed = http_parser_execute(&conn->parser, &g_settings, in->data+in->pos, size);
+    in->pos += parsed;
+    if (HTTP_PARSER_ERRNO(&conn->parser) == HPE_PAUSED) {
+        return 1;
+    }
+    if (parsed != size) {
+        __WARN("__httpd_read parsed: %d, nread:%d, %s", parsed, size,
+               http_errno_name(HTTP_PARSER_ERRNO(&conn->parser)));
+        return -1;
+    }
+    return 0;
+}
+
+/* read and parse until the socket is drained or the per wakeup budget is
+ * spent, so one connection cannot starve the others on the loop. With
+ * completion I/O the kernel did the reading, only the input __httpd_recv
+ * appended is parsed. Returns -1 once conn is freed. */
+static int
+__httpd_connection_read(struct libhttpd_connection *conn) {
+    struct libhttpd *httpd;
+    struct libhttpd_input *in;
+    int nread, want, held, budget, error = 0, eof = 0;
+
+    httpd = conn->httpd;
+    __httpd_undrained_del(conn);
+    if (conn->paused || conn->throttled) return 0;
+
+    conn->busy = 1;
+    /* input left over when the parser paused. */
+    if (conn->in && conn->in->pos < conn->in->size) {
+        if (__httpd_connection_parse(conn) == -1) error = 1;
+    }
+    budget = httpd->io ? 0 : LIBHTTPD_READ_BUDGET;
+    for (; budget > 0 && !error && !conn->paused && !conn->throttled && conn->close == 0;
+         budget--) {
+        held = conn->in ? conn->in->cap : 0;
+        __httpd_input_reserve(conn);
+        in = conn->in;
+        if (in->cap != held) __httpd_mem(conn, in->cap - held);
+        want = in->cap - in->size;
+        nread = read(conn->fd, in->data+in->size, want);
+        __DEBUG("__httpd_read read %d", nread);
+        if (nread == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) {
+                __WARN("__httpd_read reading from connection: %s", strerror(errno));
+                error = 1;
+            }
+            break;
+        } else if (nread == 0) {
+            __DEBUG("__httpd_read connection closed");
+            eof = 1;
+            break;
+        }
+        conn->last_active = aeGetMonotonicTime(httpd->el);
+        in->size += nread;
+        if (__httpd_connection_parse(conn) == -1) {
+            error = 1;
+            break;
+        }
+        /* a short read drained the socket, level-triggered polling wakes
+         * us for anything newer. edge-triggered must see EAGAIN. */
+        if (!httpd->edge && nread < want) break;
+    }
+    conn->busy = 0;
+    if (conn->eof && !conn->paused && !conn->throttled) eof = 1;
+
+    /* all parsed and no head in progress: hand the block back, to the spare
+     * slot unless requests still point into it. */
+    in = conn->in;
+    if (in && in->pos == in->size && !(conn->req && !conn->req->head_done)) {
+        __httpd_mem(conn, -in->cap);
+        __httpd_input_unref(httpd, in);
+        conn->in = 0;
+    }
+
+    if (error || conn->close == 2) {
+        conn->close = 1;
+        __httpd_connection_free(conn);
+        return -1;
+    }
+    if (eof || conn->close) __httpd_message_abort(conn);
+    if (eof) {
+        /* peer half-closed, flush what is queued before closing. */
+        if (conn->buffer.head || conn->nqueued) {
+            conn->close = 1;
+            __httpd_input_stop(conn);
+            return 0;
+        }
+        __httpd_connection_free(conn);
+        return -1;
+    }
+    /* closing after the queued output, at the pipeline limit or over the
+     * high watermark: stop polling for input. edge-triggered keeps its
+     * registration, the socket is drained again on resume. */
+    if (conn->close || ((conn->paused || conn->throttled) && !httpd->edge)) {
+        __httpd_input_stop(conn);
+        return 0;
+    }
+    if (httpd->io) return __httpd_input_start(conn);
+    /* out of budget: level-triggered fires again by itself, edge-triggered
+     * is resumed from beforesleep. */
+    if (budget == 0 && httpd->edge) __httpd_undrained_add(conn);
     return 0;
 }
 
 static void
 __httpd_read(aeEventLoop *el, int fd, void *privdata, int mask) {
-    struct libhttpd_connection *conn;
-    int nread, parsed;
-    char buff[LIBHTTPD_READ_LEN];
     UNUSED(el);
+    UNUSED(fd);
     UNUSED(mask);
 
-    static http_parser_settings settings = {
-        .on_message_begin = __httpd_on_message_begin,
-        .on_url = __httpd_on_url,
-        .on_status = __httpd_on_status,
-        .on_header_field = __httpd_on_header_field,
-        .on_header_value = __httpd_on_header_value,
-        .on_headers_complete = __httpd_on_headers_complete,
-        .on_body = __httpd_on_body,
-        .on_message_complete = __httpd_on_message_complete
-    };
-
-    conn = (struct libhttpd_connection *)privdata;
+    __httpd_connection_read((struct libhttpd_connection *)privdata);
+}
 
-    nread = read(fd, buff, LIBHTTPD_READ_LEN);
-    __DEBUG("__httpd_read read %d", nread);
-    if (nread == -1) {
-        if (errno == EAGAIN) {
-            return;
-        } else {
-            __WARN("__httpd_read reading from connection: %s", strerror(errno));
-            conn->close = 1;
-            __httpd_connection_free(conn);
-            return;
+/* completion of the multishot recv: data is a buffer of the loop, copied
+ * to conn->in and parsed like a read. */
+static void
+__httpd_recv(aeEventLoop *el, aeIo *io, int res, char *data, int flags) {
+    struct libhttpd_connection *conn = (struct libhttpd_connection *)io->clientData;
+    struct libhttpd_input *in;
+    int held, n;
+    UNUSED(flags);
+
+    if (conn->dead) {
+        __httpd_connection_put(conn);
+        return;
+    }
+    __DEBUG("__httpd_recv %d", res);
+    if (res > 0 && !conn->close) {
+        conn->last_active = aeGetMonotonicTime(el);
+        while (res > 0) {
+            held = conn->in ? conn->in->cap : 0;
+            __httpd_input_reserve(conn);
+            in = conn->in;
+            if (in->cap != held) __httpd_mem(conn, in->cap - held);
+            n = in->cap - in->size;
+            if (n > res) n = res;
+            memcpy(in->data+in->size, data, n);
+            in->size += n;
+            data += n;
+            res -= n;
         }
-    } else if (nread == 0) {
-        __DEBUG("__httpd_read connection closed");
+        __httpd_connection_read(conn);
+        return;
+    }
+    if (res == 0) {
+        __DEBUG("__httpd_recv connection closed");
+        conn->eof = 1;
+        __httpd_connection_read(conn);
+        return;
+    }
+    /* out of ring buffers, or cancelled and maybe resumed since. */
+    if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+        __WARN("__httpd_recv reading from connection: %s", strerror(-res));
+        conn->close = 1;
         __httpd_connection_free(conn);
         return;
     }
-    parsed = http_parser_execute(&conn->parser, &settings, buff, nread);
-    if (parsed != nread) {
-        __WARN("__httpd_read parsed: %d, nread:%d", parsed, nread);
+    __httpd_input_start(conn);
+}
+
+/* edge-triggered connections register both directions once with a single
+ * handler, so no further epoll_ctl is needed for their lifetime. */
+static void
+__httpd_io(aeEventLoop *el, int fd, void *privdata, int mask) {
+    struct libhttpd_connection *conn = (struct libhttpd_connection *)privdata;
+    UNUSED(el);
+    UNUSED(fd);
+
+    if (mask & AE_READABLE) {
+        if (__httpd_connection_read(conn) == -1) return;
+    }
+    if (mask & AE_WRITABLE) {
+        conn->write_wait = 0;
+        if (conn->buffer.head) __libhttpd_connection_write(conn);
+    }
+}
+
+/* over the global memory cap: close the connections of this loop holding
+ * the most, largest first, while the loop holds more than its share of the
+ * cap. Loops within their share leave the eviction to the others. */
+static void
+__httpd_mem_evict(struct libhttpd *httpd) {
+    struct libhttpd_connection *conn, *worst;
+    long long total;
+
+    while ((total = libhttpd_memory_used()) > g_mem_max && httpd->mem > g_mem_max/g_nhttpds) {
+        worst = 0;
+        for (conn = httpd->conns; conn; conn = conn->next) {
+            if (!worst || conn->mem > worst->mem) worst = conn;
+        }
+        if (!worst || worst->mem == 0) break;
+        __WARN("closing connection fd:%d holding %lld bytes, %lld over the %lld cap "
+               "(heap %zu, rss %zu, fragmentation %.2f)", worst->fd, worst->mem, total-g_mem_max,
+               g_mem_max, zmalloc_used_memory(), zmalloc_get_rss(),
+               zmalloc_get_fragmentation_ratio(zmalloc_get_rss()));
+        worst->close = 1;
+        __httpd_connection_free(worst);
+    }
+}
+
+static void
+__httpd_wake_workers(struct libhttpd *httpd);
+
+static void
+__httpd_before_sleep(aeEventLoop *el) {
+    struct libhttpd *httpd = (struct libhttpd *)el->privdata;
+    struct libhttpd_connection *conn, *next;
+
+    conn = httpd->undrained;
+    while (conn) {
+        next = conn->undrained_next;
+        __httpd_connection_read(conn);
+        conn = next;
+    }
+
+    /* one write per connection for everything produced this pass. */
+    conn = httpd->flush;
+    while (conn) {
+        next = conn->flush_next;
+        __libhttpd_connection_write(conn);
+        conn = next;
+    }
+    if (g_mem_max > 0 && httpd->mem > g_mem_max/g_nhttpds) __httpd_mem_evict(httpd);
+    if (httpd->io) __httpd_wake_workers(httpd);
+    aeSetDontWait(el, httpd->undrained != 0);
+}
+
+/* raise the soft fd limit if asked to, and remember it as the ceiling the
+ * event loops may grow to. */
+static void
+__httpd_nofile(void) {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        __WARN("getrlimit RLIMIT_NOFILE: %s", strerror(errno));
+        return;
+    }
+    if (g_nofile != 0 && rl.rlim_cur != rl.rlim_max) {
+        rlim_t want = g_nofile < 0 ? rl.rlim_max : (rlim_t)g_nofile;
+
+        if (want > rl.rlim_max) want = rl.rlim_max;
+        if (want > rl.rlim_cur) {
+            rlim_t old = rl.rlim_cur;
+
+            rl.rlim_cur = want;
+            if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+                __WARN("setrlimit RLIMIT_NOFILE %llu: %s", (unsigned long long)want, strerror(errno));
+                rl.rlim_cur = old;
+            } else {
+                __INFO("raised RLIMIT_NOFILE from %llu to %llu", (unsigned long long)old, (unsigned long long)want);
+            }
+        }
+    }
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT32_MAX) {
+        g_maxfds = INT32_MAX;
+    } else if (rl.rlim_cur > LIBHTTPD_SETSIZE) {
+        g_maxfds = (int)rl.rlim_cur;
+    }
+}
+
+/* make room for fd in the loop, doubling the set size up to RLIMIT_NOFILE
+ * instead of failing aeCreateFileEvent once fd reaches the set size. */
+static int
+__httpd_reserve(aeEventLoop *el, int fd) {
+    int setsize = aeGetSetSize(el);
+
+    if (fd < setsize) return 0;
+    while (setsize <= fd && setsize < g_maxfds) {
+        setsize = setsize > g_maxfds / 2 ? g_maxfds : setsize * 2;
+    }
+    if (fd >= setsize || aeResizeSetSize(el, setsize) == AE_ERR) {
+        __WARN("aeResizeSetSize %d for fd:%d failed", setsize, fd);
+        return -1;
     }
+    __DEBUG("__httpd_reserve setsize:%d", setsize);
+    return 0;
+}
+
+/* fires keepalive after the connection was set up, and again for whatever
+ * is left of the timeout since its last read or write. A connection waiting
+ * on its handler is left alone. */
+static int
+__httpd_idle(aeEventLoop *el, long long id, void *privdata) {
+    struct libhttpd_connection *conn = (struct libhttpd_connection *)privdata;
+    long long idle;
+    UNUSED(id);
+
+    idle = aeGetMonotonicTime(el) - conn->last_active;
+    if (conn->queue.head && conn->queue.head->complete) idle = 0;
+    if (idle < conn->httpd->keepalive) return (int)(conn->httpd->keepalive - idle);
+
+    __DEBUG("__httpd_idle fd:%d", conn->fd);
+    conn->timer = -1;
+    conn->close = 1;
+    __httpd_connection_free(conn);
+    return AE_NOMORE;
 }
 
 static void
 __httpd_connection(struct libhttpd *httpd, int fd, char *ip) {
-    int keepalive = 300;
+    int rc, keepalive = 300;
     struct libhttpd_connection *conn;
 
-    conn = (struct libhttpd_connection *)malloc(sizeof *conn);
+    conn = (struct libhttpd_connection *)__httpd_pool_get(httpd, &httpd->conn_pool);
     memset(conn, 0, sizeof *conn);
 
     anetNonBlock(0, fd);
     anetEnableTcpNoDelay(0, fd);
     anetKeepAlive(0, fd, keepalive);
-
-    if (aeCreateFileEvent(httpd->el, fd, AE_READABLE, __httpd_read, conn) == AE_ERR) {
+#ifdef TCP_NOTSENT_LOWAT
+    /* keep the kernel send queue short, the rest waits in conn->buffer
+     * where the watermarks see it. */
+    if (httpd->notsent_lowat > 0
+        && setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &httpd->notsent_lowat, sizeof(int)) == -1) {
+        __WARN("setsockopt TCP_NOTSENT_LOWAT: %s", strerror(errno));
+    }
+#endif
+
+    /* file segments still wait for the socket through file events. */
+    if (__httpd_reserve(httpd->el, fd) != 0) {
+        rc = AE_ERR;
+    } else if (httpd->io) {
+        conn->rio.fd = conn->wio.fd = fd;
+        conn->rio.proc = __httpd_recv;
+        conn->wio.proc = __httpd_sent;
+        conn->rio.clientData = conn->wio.clientData = conn;
+        rc = aeIoRecv(httpd->el, &conn->rio);
+    } else if (httpd->edge) {
+        rc = aeCreateFileEvent(httpd->el, fd, AE_READABLE|AE_WRITABLE|AE_EDGE, __httpd_io, conn);
+    } else {
+        rc = aeCreateFileEvent(httpd->el, fd, AE_READABLE, __httpd_read, conn);
+    }
+    if (rc == AE_ERR) {
         __WARN("aeCreateFileEvent AE_READABLE __httpd_read fail");
         close(fd);
-        free(conn);
+        __httpd_pool_put(&httpd->conn_pool, conn);
+        __atomic_sub_fetch(&httpd->nconn, 1, __ATOMIC_RELAXED);
         return;
     }
 
     conn->fd = fd;
     conn->httpd = httpd;
+    conn->timer = -1;
+    conn->last_active = aeGetMonotonicTime(httpd->el);
+    if (httpd->keepalive > 0) {
+        conn->timer = aeCreateTimeEvent(httpd->el, httpd->keepalive, __httpd_idle, conn, 0);
+    }
 
     http_parser_init(&conn->parser, HTTP_REQUEST);
     conn->parser.data = conn;
+
+    conn->next = httpd->conns;
+    if (httpd->conns) httpd->conns->prev = conn;
+    httpd->conns = conn;
+}
+
+static int
+__httpd_queue_init(struct libhttpd_queue *q, unsigned size) {
+    q->fds = (int *)libhttpd_malloc(size * sizeof(int));
+    if (!q->fds) return -1;
+    q->mask = size - 1;
+    q->head = q->tail = 0;
+    return 0;
+}
+
+static int
+__httpd_queue_push(struct libhttpd_queue *q, int fd) {
+    unsigned head, tail;
+
+    head = q->head;
+    tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > q->mask) return -1;
+    q->fds[head & q->mask] = fd;
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int
+__httpd_queue_pop(struct libhttpd_queue *q) {
+    unsigned head, tail;
+    int fd;
+
+    tail = q->tail;
+    head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if (head == tail) return -1;
+    fd = q->fds[tail & q->mask];
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return fd;
+}
+
+static int
+__httpd_notify_init(struct libhttpd *httpd) {
+#ifdef __linux__
+    httpd->notify[0] = httpd->notify[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (httpd->notify[0] == -1) return -1;
+#else
+    if (pipe(httpd->notify) == -1) return -1;
+    anetNonBlock(0, httpd->notify[0]);
+    anetNonBlock(0, httpd->notify[1]);
+#endif
+    return 0;
+}
+
+static void
+__httpd_notify_signal(struct libhttpd *httpd) {
+    uint64_t one = 1;
+    ssize_t n;
+
+#ifdef __linux__
+    n = write(httpd->notify[1], &one, sizeof one);
+#else
+    n = write(httpd->notify[1], &one, 1);
+#endif
+    UNUSED(n);
+}
+
+static void
+__httpd_notify_read(aeEventLoop *el, int fd, void *privdata, int mask) {
+    struct libhttpd *httpd = (struct libhttpd *)privdata;
+    uint64_t buff[64];
+    int cfd;
+    UNUSED(el);
+    UNUSED(mask);
+
+    while (read(fd, buff, sizeof buff) > 0) {}
+    while ((cfd = __httpd_queue_pop(&httpd->queue)) != -1) {
+        __DEBUG("__httpd_notify_read fd:%d", cfd);
+        __httpd_connection(httpd, cfd, 0);
+    }
+    __httpd_mailbox(httpd);
+}
+
+static struct libhttpd *
+__httpd_dispatch_roundrobin(struct libhttpd *acceptor) {
+    return &acceptor->workers[acceptor->next++ % acceptor->nworkers];
+}
+
+static struct libhttpd *
+__httpd_dispatch_leastconn(struct libhttpd *acceptor) {
+    struct libhttpd *worker, *least = 0;
+    int i, nconn, min = 0;
+
+    /* start from a rotating offset so ties do not all land on worker 0. */
+    for (i = 0; i < acceptor->nworkers; i++) {
+        worker = &acceptor->workers[(acceptor->next + i) % acceptor->nworkers];
+        nconn = __atomic_load_n(&worker->nconn, __ATOMIC_RELAXED);
+        if (!least || nconn < min) {
+            least = worker;
+            min = nconn;
+        }
+    }
+    acceptor->next++;
+    return least;
+}
+
+static libhttpd_dispatch_fn
+__httpd_dispatch_fn(int dispatch) {
+    switch (dispatch) {
+    case LIBHTTPD_DISPATCH_ROUNDROBIN: return __httpd_dispatch_roundrobin;
+    case LIBHTTPD_DISPATCH_LEASTCONN: return __httpd_dispatch_leastconn;
+    default: return 0;
+    }
+}
+
+static int
+__httpd_dispatch_push(struct libhttpd *worker, int fd) {
+    __atomic_add_fetch(&worker->nconn, 1, __ATOMIC_RELAXED);
+    if (__httpd_queue_push(&worker->queue, fd) != 0) {
+        __atomic_sub_fetch(&worker->nconn, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    worker->pending = 1;
+    return 0;
+}
+
+static void
+__httpd_dispatch(struct libhttpd *acceptor, int fd) {
+    int i;
+
+    if (__httpd_dispatch_push(acceptor->dispatch(acceptor), fd) == 0) return;
+    for (i = 0; i < acceptor->nworkers; i++) {
+        if (__httpd_dispatch_push(&acceptor->workers[i], fd) == 0) return;
+    }
+    __WARN("__httpd_dispatch all worker queues are full, drop fd:%d", fd);
+    close(fd);
+}
+
+static void
+__httpd_accept_fd(struct libhttpd *httpd, int cfd, char *cip) {
+    if (httpd->dispatch) {
+        __httpd_dispatch(httpd, cfd);
+    } else {
+        __atomic_add_fetch(&httpd->nconn, 1, __ATOMIC_RELAXED);
+        __httpd_connection(httpd, cfd, cip);
+    }
+}
+
+/* wake each worker at most once per accept batch. */
+static void
+__httpd_wake_workers(struct libhttpd *httpd) {
+    int i;
+
+    for (i = 0; i < httpd->nworkers; i++) {
+        if (httpd->workers[i].pending) {
+            httpd->workers[i].pending = 0;
+            __httpd_notify_signal(&httpd->workers[i]);
+        }
+    }
 }
 
 static void
@@ -636,38 +2934,199 @@ __httpd_accept(aeEventLoop *el, int fd, void *privdata, int mask) {
         if (cfd == ANET_ERR) {
             if (errno != EWOULDBLOCK)
                 __WARN("anetTcpAccept: %s", httpd->neterr);
-            return;
+            break;
         }
         __DEBUG("__httpd_accept %s:%d", cip, cport);
-        __httpd_connection(httpd, cfd, cip);
+        __httpd_accept_fd(httpd, cfd, cip);
     }
+    __httpd_wake_workers(httpd);
 }
 
-void libhttpd__serve(char *host, int port, void *ud, libhttpd_cb cb) {
-    struct libhttpd httpd = {};
+/* completion of the multishot accept, one per connection. Workers are
+ * woken from beforesleep, once for the whole pass. */
+static void
+__httpd_accepted(aeEventLoop *el, aeIo *io, int res, char *data, int flags) {
+    struct libhttpd *httpd = (struct libhttpd *)io->clientData;
+    UNUSED(data);
+
+    if (res >= 0) {
+        __DEBUG("__httpd_accepted fd:%d", res);
+        __httpd_accept_fd(httpd, res, 0);
+    } else if (res != -ECANCELED) {
+        __WARN("__httpd_accepted: %s", strerror(-res));
+    }
+    if (!(flags & AE_IO_MORE) && res != -ECANCELED && aeIoAccept(el, io) == AE_ERR) {
+        __ERROR("aeIoAccept __httpd_accepted failed");
+    }
+}
 
-    httpd.ud = ud;
-    httpd.cb = cb;
+static int
+__httpd_loop(struct libhttpd *httpd) {
+    int i;
 
-    if ((httpd.el = aeCreateEventLoop(128)) == 0) {
+    httpd->fd = -1;
+    httpd->notify[0] = httpd->notify[1] = -1;
+    if ((httpd->el = aeCreateEventLoop(LIBHTTPD_SETSIZE)) == 0) {
         __ERROR("aeCreateEventLoop failed");
-        exit(1);
+        return -1;
     }
+    httpd->edge = g_edge;
+    /* completion I/O reads whatever arrives, edge-triggered reads have no
+     * meaning there. */
+    if ((httpd->io = aeIoSupported(httpd->el))) httpd->edge = 0;
+    httpd->hugepages = g_hugepages;
+    httpd->conn_mem_max = g_conn_mem_max;
+    __httpd_pool_init(&httpd->conn_pool, sizeof(struct libhttpd_connection));
+    __httpd_pool_init(&httpd->buffer_pool, sizeof(struct libhttpd_buffer));
+    for (i = 0; i < LIBHTTPD_DATA_CLASSES; i++) {
+        __httpd_pool_init(&httpd->data_pool[i], g_data_class[i]);
+    }
+    httpd->el->privdata = httpd;
+    aeSetBeforeSleepProc(httpd->el, __httpd_before_sleep);
+    __httpd_clock_sync(httpd);
+    return 0;
+}
 
-    httpd.fd = anetTcpServer(httpd.neterr, port, host, LIBHTTPD_BACKLOG);
-    if (httpd.fd == ANET_ERR) {
-        __ERROR("anetTcpServer: %s", httpd.neterr);
-        exit(1);
+static int
+__httpd_listen(struct libhttpd *httpd, char *host, int port, int reuseport) {
+    if (reuseport) {
+        httpd->fd = anetTcpReusePortServer(httpd->neterr, port, host, LIBHTTPD_BACKLOG);
+    } else {
+        httpd->fd = anetTcpServer(httpd->neterr, port, host, LIBHTTPD_BACKLOG);
+    }
+    if (httpd->fd == ANET_ERR) {
+        __ERROR("anetTcpServer: %s", httpd->neterr);
+        return -1;
     }
-    anetNonBlock(0, httpd.fd);
-    if (aeCreateFileEvent(httpd.el, httpd.fd, AE_READABLE, __httpd_accept, &httpd) == AE_ERR) {
+    anetNonBlock(0, httpd->fd);
+    if (httpd->io) {
+        httpd->accept_io.fd = httpd->fd;
+        httpd->accept_io.proc = __httpd_accepted;
+        httpd->accept_io.clientData = httpd;
+        if (aeIoAccept(httpd->el, &httpd->accept_io) == AE_ERR) {
+            __ERROR("aeIoAccept __httpd_accepted failed");
+            return -1;
+        }
+        return 0;
+    }
+    if (__httpd_reserve(httpd->el, httpd->fd) != 0
+        || aeCreateFileEvent(httpd->el, httpd->fd, AE_READABLE, __httpd_accept, httpd) == AE_ERR) {
         __ERROR("aeCreateFileEvent AE_READABLE __httpd_accept failed");
-        exit(1);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+__httpd_worker(struct libhttpd *httpd) {
+    pthread_mutex_init(&httpd->mailbox_lock, 0);
+    if (__httpd_queue_init(&httpd->queue, LIBHTTPD_QUEUE_LEN) != 0) {
+        __ERROR("__httpd_queue_init failed");
+        return -1;
+    }
+    if (__httpd_notify_init(httpd) != 0) {
+        __ERROR("__httpd_notify_init: %s", strerror(errno));
+        return -1;
+    }
+    if (__httpd_reserve(httpd->el, httpd->notify[0]) != 0
+        || aeCreateFileEvent(httpd->el, httpd->notify[0], AE_READABLE, __httpd_notify_read, httpd) == AE_ERR) {
+        __ERROR("aeCreateFileEvent AE_READABLE __httpd_notify_read failed");
+        return -1;
+    }
+    return 0;
+}
+
+static void *
+__httpd_run(void *arg) {
+    struct libhttpd *httpd = (struct libhttpd *)arg;
+    int i;
+
+    t_httpd = httpd;
+    aeMain(httpd->el);
+    if (httpd->fd != -1) {
+        aeDeleteFileEvent(httpd->el, httpd->fd, AE_READABLE);
+        close(httpd->fd);
+    }
+    if (httpd->notify[0] != -1) {
+        aeDeleteFileEvent(httpd->el, httpd->notify[0], AE_READABLE);
+        close(httpd->notify[0]);
+        if (httpd->notify[1] != httpd->notify[0]) close(httpd->notify[1]);
+        libhttpd_free(httpd->queue.fds);
+        pthread_mutex_destroy(&httpd->mailbox_lock);
+    }
+    libhttpd_free(httpd->spare);
+    __httpd_pool_destroy(&httpd->conn_pool);
+    __httpd_pool_destroy(&httpd->buffer_pool);
+    for (i = 0; i < LIBHTTPD_DATA_CLASSES; i++) {
+        __httpd_pool_destroy(&httpd->data_pool[i]);
+    }
+    aeDeleteEventLoop(httpd->el);
+    return 0;
+}
+
+void libhttpd__serve(char *host, int port, void *ud, libhttpd_cb cb) {
+    struct libhttpd acceptor = {};
+    struct libhttpd *httpds;
+    libhttpd_dispatch_fn dispatch;
+    int i, rc, threads = g_threads;
+
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads <= 0) threads = 1;
+    }
+    dispatch = __httpd_dispatch_fn(g_dispatch);
+    __httpd_nofile();
+
+    httpds = (struct libhttpd *)libhttpd_malloc(threads * sizeof *httpds);
+    memset(httpds, 0, threads * sizeof *httpds);
+    g_httpds = httpds;
+    g_nhttpds = threads;
+
+    /* deferred responses allocate off the loops even with one thread. Each
+     * thread counts locally, the shared counter is updated once per batch. */
+    zmalloc_enable_thread_safeness();
+    for (i = 0; i < threads; i++) {
+        httpds[i].ud = ud;
+        httpds[i].cb = cb;
+        httpds[i].headers_cb = g_headers_cb;
+        httpds[i].max_body = g_max_body;
+        httpds[i].keepalive = (long long)g_keepalive*1000;
+        httpds[i].max_requests = g_max_requests;
+        httpds[i].low_watermark = g_low_watermark;
+        httpds[i].high_watermark = g_high_watermark;
+        httpds[i].notsent_lowat = g_notsent_lowat;
+        if (__httpd_loop(&httpds[i]) != 0) exit(1);
+        /* the fd queue feeds workers from the acceptor, the notify wakeup
+         * also delivers deferred responses completed on other threads. */
+        if (__httpd_worker(&httpds[i]) != 0) exit(1);
+        if (!dispatch) {
+            /* every worker owns a SO_REUSEPORT listener, the kernel spreads
+             * new connections across them with no shared state. */
+            if (__httpd_listen(&httpds[i], host, port, threads > 1) != 0) exit(1);
+        }
     }
 
-    __INFO("libhttpd serve at: %s:%d", host, port);
-    aeMain(httpd.el);
-    aeDeleteFileEvent(httpd.el, httpd.fd, AE_READABLE);
-    close(httpd.fd);
-    aeDeleteEventLoop(httpd.el);
+    __INFO("libhttpd serve at: %s:%d with %d thread(s)", host, port, threads);
+    for (i = dispatch ? 0 : 1; i < threads; i++) {
+        if ((rc = pthread_create(&httpds[i].thread, 0, __httpd_run, &httpds[i])) != 0) {
+            __ERROR("pthread_create: %s", strerror(rc));
+            exit(1);
+        }
+    }
+    if (dispatch) {
+        acceptor.workers = httpds;
+        acceptor.nworkers = threads;
+        acceptor.dispatch = dispatch;
+        if (__httpd_loop(&acceptor) != 0) exit(1);
+        if (__httpd_listen(&acceptor, host, port, 0) != 0) exit(1);
+        __httpd_run(&acceptor);
+    } else {
+        __httpd_run(&httpds[0]);
+    }
+    for (i = dispatch ? 0 : 1; i < threads; i++) {
+        pthread_join(httpds[i].thread, 0);
+    }
+    g_httpds = 0;
+    g_nhttpds = 0;
+    libhttpd_free(httpds);
 }
@@ -47,26 +47,247 @@ enum {
     LIBHTTPD_LOG_ERROR,
 };
 
+/* libhttpd connection dispatch enums. */
+enum {
+    LIBHTTPD_DISPATCH_REUSEPORT,
+    LIBHTTPD_DISPATCH_ROUNDROBIN,
+    LIBHTTPD_DISPATCH_LEASTCONN,
+};
+
+/* common request headers, looked up by id with libhttpd_request_header_id. */
+enum {
+    LIBHTTPD_HEADER_HOST,
+    LIBHTTPD_HEADER_CONTENT_LENGTH,
+    LIBHTTPD_HEADER_CONTENT_TYPE,
+    LIBHTTPD_HEADER_CONNECTION,
+    LIBHTTPD_HEADER_ACCEPT,
+    LIBHTTPD_HEADER_ACCEPT_ENCODING,
+    LIBHTTPD_HEADER_ACCEPT_LANGUAGE,
+    LIBHTTPD_HEADER_COOKIE,
+    LIBHTTPD_HEADER_AUTHORIZATION,
+    LIBHTTPD_HEADER_USER_AGENT,
+    LIBHTTPD_HEADER_TRANSFER_ENCODING,
+    LIBHTTPD_HEADER_IF_MODIFIED_SINCE,
+    LIBHTTPD_HEADER_IF_NONE_MATCH,
+    LIBHTTPD_HEADER_RANGE,
+    LIBHTTPD_HEADER_REFERER,
+    LIBHTTPD_HEADER_ORIGIN,
+    LIBHTTPD_HEADER_UPGRADE,
+    LIBHTTPD_HEADER_EXPECT,
+    LIBHTTPD_HEADER_CACHE_CONTROL,
+    LIBHTTPD_HEADER_X_FORWARDED_FOR,
+    LIBHTTPD_HEADER_X_REAL_IP,
+    LIBHTTPD_HEADER_CONTENT_ENCODING,
+    LIBHTTPD_HEADER_IF_RANGE,
+    LIBHTTPD_HEADER_PRAGMA,
+    LIBHTTPD_HEADER_TE,
+    LIBHTTPD_HEADER_KEEP_ALIVE,
+    LIBHTTPD_HEADER_SEC_WEBSOCKET_KEY,
+    LIBHTTPD_HEADER_X_REQUEST_ID,
+    LIBHTTPD_HEADER_COUNT,
+};
+
 /* libhttpd structures. */
 struct libhttpd_request;
 struct libhttpd_response;
+struct libhttpd_shared;
 
 /* libhttpd callback. */
 typedef void (* libhttpd_cb)(void *ud, struct libhttpd_request *req, struct libhttpd_response *res);
+/* releases caller owned data once libhttpd is done with it. */
+typedef void (* libhttpd_free_cb)(void *ctx);
+/* receives a streamed request body chunk by chunk, non-zero aborts the
+ * request with 400 and closes the connection. */
+typedef int (* libhttpd_data_cb)(void *ctx, struct libhttpd_request *req, const char *data, int size);
+/* the connection of res can take more output. */
+typedef void (* libhttpd_drain_cb)(void *ctx, struct libhttpd_response *res);
+
+/* where libhttpd takes its memory from. free must take 0 like free(3). */
+struct libhttpd_allocator {
+    void *(* malloc)(size_t size);
+    void *(* realloc)(void *ptr, size_t size);
+    void (* free)(void *ptr);
+};
 
 extern LIBHTTPD_API void libhttpd__loglevel(int level);
 
+/* replace the allocator, zmalloc (over the malloc picked at configure time)
+ * by default. Call it before anything else in libhttpd allocates. */
+extern LIBHTTPD_API void libhttpd__allocator(const struct libhttpd_allocator *allocator);
+
+/* memory from the libhttpd allocator, libhttpd_free also fits as the
+ * free_cb of data handed over by reference. */
+extern LIBHTTPD_API void *libhttpd_malloc(size_t size);
+extern LIBHTTPD_API void *libhttpd_realloc(void *ptr, size_t size);
+extern LIBHTTPD_API void libhttpd_free(void *ptr);
+
+/* number of worker threads, each runs its own event loop on a SO_REUSEPORT
+ * listener. 0 means one per online cpu. Defaults to 1. */
+extern LIBHTTPD_API void libhttpd__threads(int threads);
+
+/* how new connections reach the worker loops. REUSEPORT lets the kernel
+ * hash them to per-worker listeners, the others run a dedicated acceptor
+ * loop which hands fds to workers round-robin or to the worker with the
+ * fewest live connections. */
+extern LIBHTTPD_API void libhttpd__dispatch(int dispatch);
+
+/* raise the soft RLIMIT_NOFILE to nofile (clamped to the hard limit, -1 for
+ * the hard limit itself) when serving starts. 0 leaves it alone. The event
+ * loops grow on demand up to this limit. */
+extern LIBHTTPD_API void libhttpd__nofile(int nofile);
+
+/* register connections edge-triggered for read and write once, and read
+ * each socket until EAGAIN (bounded per wakeup) instead of once per event.
+ * Defaults to 0, level-triggered. Ignored by loops built with io_uring that
+ * read through completions. */
+extern LIBHTTPD_API void libhttpd__edge(int edge);
+
+/* called once the request headers are parsed, before any body. The
+ * handler may call libhttpd_request_stream to take the body incrementally,
+ * or end res right away (e.g. 401), in which case the body is dropped and
+ * the serve callback is not called. The serve callback then runs when the
+ * request is complete, with no buffered body if it was streamed. */
+extern LIBHTTPD_API void libhttpd__on_request_headers(libhttpd_cb cb);
+
+/* largest body buffered for the serve callback, a larger Content-Length or
+ * chunked body gets 413 and the connection is closed. 0 for no limit,
+ * defaults to 8MB. Streamed bodies are not limited. */
+extern LIBHTTPD_API void libhttpd__max_body(long long size);
+
+/* close connections idle for this many seconds: no request in progress
+ * reading or writing, and no response waiting on its handler. 0 keeps them
+ * open, defaults to 60. */
+extern LIBHTTPD_API void libhttpd__keepalive(int seconds);
+
+/* close a connection after serving this many requests, 0 for no limit (the
+ * default). Clients asking for Connection: close, HTTP/1.0 clients without
+ * keep-alive and responses with a Connection: close header end the
+ * connection after that response too. */
+extern LIBHTTPD_API void libhttpd__max_requests(int requests);
+
+/* output queued on a connection, written or not, above which it stops
+ * reading requests and libhttpd_response_writable turns 0, until it drains
+ * below low. high 0 disables, defaults to 256KB and 1MB. */
+extern LIBHTTPD_API void libhttpd__watermarks(int low, int high);
+
+/* set TCP_NOTSENT_LOWAT on accepted sockets where supported, so the kernel
+ * holds only this many unsent bytes and the rest stays visible to the
+ * watermarks. 0 (the default) leaves the kernel default. */
+extern LIBHTTPD_API void libhttpd__notsent_lowat(int bytes);
+
+/* back the per loop pools of connections and output buffers with huge
+ * pages: reserved ones when available, else transparent huge pages. Off
+ * by default. */
+extern LIBHTTPD_API void libhttpd__hugepages(int on);
+
+/* memory caps in bytes, 0 for none. A connection holds its input buffer,
+ * the request bodies it buffers and its output not yet written. A body that
+ * would take its connection over conn_max is refused with 413, one that
+ * would take all connections over total_max with 503. Past total_max the
+ * connections holding the most are closed, largest first. Default to 16MB
+ * per connection and no total. */
+extern LIBHTTPD_API void libhttpd__memory(long long conn_max, long long total_max);
+
+/* bytes held by all connections, as counted against the caps. */
+extern LIBHTTPD_API long long libhttpd_memory_used(void);
+
 /* generic libhttpd request functions. */
 extern LIBHTTPD_API const char *libhttpd_request_method(struct libhttpd_request *req);
 extern LIBHTTPD_API const char *libhttpd_request_url(struct libhttpd_request *req);
+/* the first header named field, case insensitive, or 0. Headers are indexed
+ * as the request head is parsed, lookups take constant time. Trailers of a
+ * chunked body are not kept. */
 extern LIBHTTPD_API const char *libhttpd_request_header(struct libhttpd_request *req, const char *field);
+/* the same for a LIBHTTPD_HEADER_* id, without hashing the name. */
+extern LIBHTTPD_API const char *libhttpd_request_header_id(struct libhttpd_request *req, int id);
 extern LIBHTTPD_API const char *libhttpd_request_body(struct libhttpd_request *req, int *size);
+/* from the headers callback only: hand the body to cb instead of buffering it. */
+extern LIBHTTPD_API void libhttpd_request_stream(struct libhttpd_request *req, libhttpd_data_cb cb, void *ctx);
+/* monotonic milliseconds of the loop serving req, sampled once per loop pass. */
+extern LIBHTTPD_API int64_t libhttpd_request_now(struct libhttpd_request *req);
+/* scratch memory freed along with the request once its response is written,
+ * 16 byte aligned. Not thread safe, call it from the thread handling req. */
+extern LIBHTTPD_API void *libhttpd_request_alloc(struct libhttpd_request *req, int size);
 
-/* generic libhttpd response functions. */
+/* generic libhttpd response functions. A response to HEAD is written the
+ * same as to GET, libhttpd sends its headers and Content-Length only. */
 extern LIBHTTPD_API void libhttpd_response_header(struct libhttpd_response *res, const char *field, const char *value);
 extern LIBHTTPD_API char *libhttpd_response_write(struct libhttpd_response *res, const char *data, int size);
 extern LIBHTTPD_API void libhttpd_response_end(struct libhttpd_response *res, int status);
 
+/* send status and headers now and stream the body: every later write goes
+ * out as a chunk as soon as the socket takes it, anything written before
+ * begin is the first chunk, and libhttpd_response_end sends the last
+ * chunk (its status is ignored). HTTP/1.0 clients get the body unframed
+ * and the connection closed at the end. */
+extern LIBHTTPD_API void libhttpd_response_begin(struct libhttpd_response *res, int status);
+
+/* answer later: after the callback returns res and its request stay alive
+ * until libhttpd_response_end. The response may then be written and ended
+ * from the loop or from any other thread, which wakes the loop serving it,
+ * as long as calls on one response do not race each other. Headers must be
+ * set before begin or end, and off the loop the copy returned by
+ * libhttpd_response_write must not be touched. Later pipelined requests
+ * are still handled, their responses go out once this one ended. */
+extern LIBHTTPD_API void libhttpd_response_defer(struct libhttpd_response *res);
+
+/* backpressure for streaming producers: writable is 0 while the connection
+ * is over its high watermark, and on_drain calls cb(ctx, res) once, on the
+ * loop, when it drained below the low watermark (right away if writable).
+ * on_drain must be called from the loop serving res. */
+extern LIBHTTPD_API int libhttpd_response_writable(struct libhttpd_response *res);
+extern LIBHTTPD_API void libhttpd_response_on_drain(struct libhttpd_response *res, libhttpd_drain_cb cb, void *ctx);
+
+/* zero-copy body writes. data is queued as is and must stay valid until
+ * free_cb(ctx) is called, after the bytes reached the socket or the
+ * connection went away. free_cb may be called from the loop thread serving
+ * res and may be 0 for data that outlives the server. */
+extern LIBHTTPD_API void libhttpd_response_write_ref(struct libhttpd_response *res, const char *data, int size,
+                                                     libhttpd_free_cb free_cb, void *ctx);
+/* queue size bytes (-1 for the rest) at offset of a shared buffer, holding a
+ * reference until they are written. */
+extern LIBHTTPD_API void libhttpd_response_write_shared(struct libhttpd_response *res, struct libhttpd_shared *shared,
+                                                        int offset, int size);
+
+/* queue length bytes (-1 for the rest of the file) of fd at offset, sent
+ * with sendfile(2) behind whatever was written before. libhttpd takes
+ * ownership of fd and closes it when done. The _ref variant leaves fd open
+ * and calls free_cb(ctx) instead, e.g. to share one cached fd. */
+extern LIBHTTPD_API void libhttpd_response_sendfile(struct libhttpd_response *res, int fd, off_t offset, off_t length);
+extern LIBHTTPD_API void libhttpd_response_sendfile_ref(struct libhttpd_response *res, int fd, off_t offset, off_t length,
+                                                        libhttpd_free_cb free_cb, void *ctx);
+
+/* refcounted immutable buffers that any number of responses on any worker
+ * can send at once, e.g. cached payloads. new copies data (or leaves the
+ * payload uninitialized when data is 0), wrap takes ownership of caller
+ * memory and calls free_cb(ctx) when the last reference goes. Both return
+ * one reference owned by the caller. */
+extern LIBHTTPD_API struct libhttpd_shared *libhttpd_shared_new(const char *data, int size);
+extern LIBHTTPD_API struct libhttpd_shared *libhttpd_shared_wrap(char *data, int size, libhttpd_free_cb free_cb, void *ctx);
+extern LIBHTTPD_API char *libhttpd_shared_data(struct libhttpd_shared *shared);
+extern LIBHTTPD_API int libhttpd_shared_size(struct libhttpd_shared *shared);
+extern LIBHTTPD_API void libhttpd_shared_retain(struct libhttpd_shared *shared);
+extern LIBHTTPD_API void libhttpd_shared_release(struct libhttpd_shared *shared);
+
+/* static file serving. Maps urls below prefix to files below root, with
+ * Content-Type from the file extension and bodies sent with sendfile.
+ * GET and HEAD are served, ".." segments are rejected. */
+struct libhttpd_static;
+
+extern LIBHTTPD_API struct libhttpd_static *libhttpd_static_create(const char *prefix, const char *root);
+/* keep up to max files open with their stat, evicting the least recently
+ * used, and stat() a cached file again once it is older than ttl ms. 0
+ * disables the cache. Each thread serving files keeps a cache of its own,
+ * so up to max files per thread stay open. */
+extern LIBHTTPD_API void libhttpd_static_cache(struct libhttpd_static *st, int max, int ttl);
+/* serve req if its url is below prefix and return 1, else return 0 and
+ * leave res alone. */
+extern LIBHTTPD_API int libhttpd_static_serve(struct libhttpd_static *st, struct libhttpd_request *req,
+                                              struct libhttpd_response *res);
+/* libhttpd_cb taking the static handle as ud, 404 outside prefix. */
+extern LIBHTTPD_API void libhttpd_static_handler(void *ud, struct libhttpd_request *req, struct libhttpd_response *res);
+extern LIBHTTPD_API void libhttpd_static_destroy(struct libhttpd_static *st);
+
 /* generic libhttpd functions. */
 extern LIBHTTPD_API void libhttpd__serve(char *host, int port, void *ud, libhttpd_cb cb);
 
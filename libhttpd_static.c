@@ -0,0 +1,557 @@
+/*
+ * libhttpd_static.c -- static file serving on top of libhttpd.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "libhttpd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define LIBHTTPD_STATIC_PATH_LEN 4096
+#define LIBHTTPD_STATIC_INDEX "index.html"
+#define LIBHTTPD_STATIC_DEFAULT_MIME "application/octet-stream"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+/* an open file shared by the cache and the responses still sending it. */
+struct libhttpd_static_file {
+    char *path;
+    unsigned hash;
+
+    int fd;
+    off_t size;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    const char *mime;
+    char last_modified[32];
+
+    int ref;
+    int cached;
+    /* monotonic ms after which the file is stat()ed again. */
+    int64_t expire;
+
+    struct libhttpd_static_file *hnext;
+    struct libhttpd_static_file *prev;
+    struct libhttpd_static_file *next;
+};
+
+/* the files one thread keeps open. Each thread looks up and revalidates
+ * its own cache without locking, as nginx workers do with open_file_cache. */
+struct libhttpd_static_cache {
+    struct libhttpd_static *st;
+    /* settings in use, reloaded when gen no longer matches the handle's. */
+    unsigned gen;
+    int max;
+    int ttl;
+
+    /* path hash table plus an lru list, most recently used at head. */
+    struct libhttpd_static_file **table;
+    unsigned mask;
+    int count;
+    struct libhttpd_static_file *head;
+    struct libhttpd_static_file *tail;
+
+    struct libhttpd_static_cache *prev;
+    struct libhttpd_static_cache *next;
+};
+
+struct libhttpd_static {
+    char *prefix;
+    int prefix_len;
+    char *root;
+
+    /* guards the settings and the list of caches, not the caches. */
+    pthread_mutex_t lock;
+    pthread_key_t key;
+    unsigned gen;
+    int max;
+    int ttl;
+    struct libhttpd_static_cache *caches;
+};
+
+static const struct {
+    const char *ext;
+    const char *mime;
+} g_mime[] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"css", "text/css"},
+    {"js", "application/javascript"},
+    {"mjs", "application/javascript"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"xml", "application/xml"},
+    {"txt", "text/plain"},
+    {"md", "text/markdown"},
+    {"csv", "text/csv"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"svg", "image/svg+xml"},
+    {"ico", "image/x-icon"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"mp3", "audio/mpeg"},
+    {"ogg", "audio/ogg"},
+    {"wav", "audio/wav"},
+    {"mp4", "video/mp4"},
+    {"webm", "video/webm"},
+    {"pdf", "application/pdf"},
+    {"wasm", "application/wasm"},
+    {"zip", "application/zip"},
+    {"gz", "application/gzip"},
+    {"tar", "application/x-tar"},
+    {0, 0}
+};
+
+static char *
+__static_strdup(const char *str) {
+    size_t len = strlen(str) + 1;
+
+    return (char *)memcpy(libhttpd_malloc(len), str, len);
+}
+
+static const char *
+__static_mime(const char *path) {
+    const char *ext;
+    int i;
+
+    ext = strrchr(path, '.');
+    if (!ext || strchr(ext, '/')) return LIBHTTPD_STATIC_DEFAULT_MIME;
+    ext++;
+    for (i = 0; g_mime[i].ext; i++) {
+        if (0 == strcasecmp(g_mime[i].ext, ext)) return g_mime[i].mime;
+    }
+    return LIBHTTPD_STATIC_DEFAULT_MIME;
+}
+
+static int
+__static_hex(char c) {
+    if (c >= '0' && c <= '9') return c-'0';
+    if (c >= 'a' && c <= 'f') return c-'a'+10;
+    if (c >= 'A' && c <= 'F') return c-'A'+10;
+    return -1;
+}
+
+/* decode the url path below prefix into path, relative to root. Rejects
+ * encoded NULs and any ".." segment so requests can't leave root. */
+static int
+__static_path(struct libhttpd_static *st, const char *url, char *path, int size) {
+    const char *p, *end;
+    int hi, lo, n = 0;
+
+    p = url+st->prefix_len;
+    end = p+strcspn(p, "?#");
+    while (*p == '/') p++;
+
+    while (p < end) {
+        char c = *p++;
+        if (c == '%') {
+            if (end-p < 2 || (hi = __static_hex(p[0])) < 0 || (lo = __static_hex(p[1])) < 0) return -1;
+            c = (char)(hi << 4 | lo);
+            p += 2;
+            if (c == 0) return -1;
+        }
+        if (n >= size-1) return -1;
+        path[n++] = c;
+    }
+    path[n] = 0;
+
+    for (p = path; (p = strstr(p, "..")); p += 2) {
+        if ((p == path || p[-1] == '/') && (p[2] == 0 || p[2] == '/')) return -1;
+    }
+    if (n == 0 || path[n-1] == '/') {
+        if (n+sizeof(LIBHTTPD_STATIC_INDEX) > (size_t)size) return -1;
+        strcpy(path+n, LIBHTTPD_STATIC_INDEX);
+    }
+    return 0;
+}
+
+/* parse an HTTP-date: the IMF-fixdate sent as Last-Modified, or the
+ * obsolete RFC 850 and asctime forms clients may still send. */
+static int
+__static_date(const char *str, time_t *t) {
+    static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    static const int yday[] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+    char month[4];
+    int year, mon, day, hour, min, sec;
+    const char *p;
+    long long days;
+
+    if ((p = strchr(str, ','))) {
+        if (sscanf(p+1, " %2d %3s %4d %2d:%2d:%2d GMT", &day, month, &year, &hour, &min, &sec) != 6) {
+            if (sscanf(p+1, " %2d-%3s-%2d %2d:%2d:%2d GMT", &day, month, &year, &hour, &min, &sec) != 6) return -1;
+            year += year < 70 ? 2000 : 1900;
+        }
+    } else if (sscanf(str, "%*3s %3s %2d %2d:%2d:%2d %4d", month, &day, &hour, &min, &sec, &year) != 6) {
+        return -1;
+    }
+    for (mon = 0; mon < 12; mon++) {
+        if (0 == strcmp(months[mon], month)) break;
+    }
+    if (mon == 12 || year < 1970 || day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60) return -1;
+
+    days = (year-1970)*365LL + (year-1969)/4 - (year-1901)/100 + (year-1601)/400;
+    days += yday[mon] + day-1;
+    if (mon > 1 && year%4 == 0 && (year%100 != 0 || year%400 == 0)) days++;
+    *t = (time_t)(days*86400 + hour*3600 + min*60 + sec);
+    return 0;
+}
+
+static unsigned
+__static_hash(const char *path) {
+    unsigned h = 2166136261u;
+
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct libhttpd_static_file *
+__static_open(struct libhttpd_static *st, const char *path, int *err) {
+    struct libhttpd_static_file *file;
+    char full[LIBHTTPD_STATIC_PATH_LEN*2];
+    struct stat sb;
+    struct tm tm;
+    int fd;
+
+    snprintf(full, sizeof(full), "%s/%s", st->root, path);
+    if ((fd = open(full, O_RDONLY|O_CLOEXEC)) == -1) {
+        *err = errno;
+        return 0;
+    }
+    if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+        *err = ENOENT;
+        close(fd);
+        return 0;
+    }
+
+    file = (struct libhttpd_static_file *)libhttpd_malloc(sizeof *file);
+    memset(file, 0, sizeof *file);
+    file->path = __static_strdup(path);
+    file->hash = __static_hash(path);
+    file->fd = fd;
+    file->size = sb.st_size;
+    file->dev = sb.st_dev;
+    file->ino = sb.st_ino;
+    file->mtime = sb.st_mtime;
+    file->mime = __static_mime(path);
+    gmtime_r(&sb.st_mtime, &tm);
+    strftime(file->last_modified, sizeof(file->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    file->ref = 1;
+    return file;
+}
+
+static void
+__static_file_free(struct libhttpd_static_file *file) {
+    close(file->fd);
+    libhttpd_free(file->path);
+    libhttpd_free(file);
+}
+
+/* drop a reference held by the cache or by a response still sending. */
+static void
+__static_unref(struct libhttpd_static_file *file) {
+    if (__atomic_sub_fetch(&file->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+        __static_file_free(file);
+    }
+}
+
+static void
+__static_sendfile_done(void *ctx) {
+    __static_unref((struct libhttpd_static_file *)ctx);
+}
+
+static void
+__static_lru_unlink(struct libhttpd_static_cache *cache, struct libhttpd_static_file *file) {
+    if (file->prev) file->prev->next = file->next;
+    else cache->head = file->next;
+    if (file->next) file->next->prev = file->prev;
+    else cache->tail = file->prev;
+    file->prev = file->next = 0;
+}
+
+static void
+__static_lru_push(struct libhttpd_static_cache *cache, struct libhttpd_static_file *file) {
+    file->prev = 0;
+    file->next = cache->head;
+    if (cache->head) cache->head->prev = file;
+    else cache->tail = file;
+    cache->head = file;
+}
+
+static void
+__static_evict(struct libhttpd_static_cache *cache, struct libhttpd_static_file *file) {
+    struct libhttpd_static_file **pp;
+
+    pp = &cache->table[file->hash & cache->mask];
+    while (*pp != file) pp = &(*pp)->hnext;
+    *pp = file->hnext;
+    __static_lru_unlink(cache, file);
+    file->cached = 0;
+    cache->count--;
+    __static_unref(file);
+}
+
+static void
+__static_insert(struct libhttpd_static_cache *cache, struct libhttpd_static_file *file, int64_t now) {
+    unsigned slot = file->hash & cache->mask;
+
+    while (cache->count >= cache->max && cache->tail) __static_evict(cache, cache->tail);
+    file->hnext = cache->table[slot];
+    cache->table[slot] = file;
+    __static_lru_push(cache, file);
+    file->cached = 1;
+    file->expire = now+cache->ttl;
+    __atomic_add_fetch(&file->ref, 1, __ATOMIC_RELAXED);
+    cache->count++;
+}
+
+static struct libhttpd_static_file *
+__static_lookup(struct libhttpd_static_cache *cache, const char *path, unsigned hash) {
+    struct libhttpd_static_file *file;
+
+    for (file = cache->table[hash & cache->mask]; file; file = file->hnext) {
+        if (file->hash == hash && 0 == strcmp(file->path, path)) break;
+    }
+    return file;
+}
+
+/* drop every file and size the table for the settings of st, called with
+ * st->lock held. */
+static void
+__static_cache_reset(struct libhttpd_static_cache *cache, struct libhttpd_static *st) {
+    unsigned size = 16;
+
+    while (cache->head) __static_evict(cache, cache->head);
+    libhttpd_free(cache->table);
+    cache->table = 0;
+    cache->gen = st->gen;
+    cache->max = st->max;
+    cache->ttl = st->ttl;
+    if (cache->max) {
+        while (size < (unsigned)cache->max*2) size <<= 1;
+        cache->table = (struct libhttpd_static_file **)libhttpd_malloc(size * sizeof(*cache->table));
+        memset(cache->table, 0, size * sizeof(*cache->table));
+        cache->mask = size-1;
+    }
+}
+
+static void
+__static_cache_free(struct libhttpd_static_cache *cache) {
+    while (cache->head) __static_evict(cache, cache->head);
+    libhttpd_free(cache->table);
+    libhttpd_free(cache);
+}
+
+/* the thread exited, its cache goes with it. */
+static void
+__static_cache_exit(void *ud) {
+    struct libhttpd_static_cache *cache = (struct libhttpd_static_cache *)ud;
+    struct libhttpd_static *st = cache->st;
+
+    pthread_mutex_lock(&st->lock);
+    if (cache->prev) cache->prev->next = cache->next;
+    else st->caches = cache->next;
+    if (cache->next) cache->next->prev = cache->prev;
+    pthread_mutex_unlock(&st->lock);
+    __static_cache_free(cache);
+}
+
+/* the cache of the calling thread, created on first use and reset when
+ * libhttpd_static_cache changed the settings since. */
+static struct libhttpd_static_cache *
+__static_cache(struct libhttpd_static *st) {
+    struct libhttpd_static_cache *cache;
+
+    cache = (struct libhttpd_static_cache *)pthread_getspecific(st->key);
+    if (!cache) {
+        cache = (struct libhttpd_static_cache *)libhttpd_malloc(sizeof *cache);
+        memset(cache, 0, sizeof *cache);
+        cache->st = st;
+        pthread_mutex_lock(&st->lock);
+        __static_cache_reset(cache, st);
+        cache->next = st->caches;
+        if (st->caches) st->caches->prev = cache;
+        st->caches = cache;
+        pthread_mutex_unlock(&st->lock);
+        pthread_setspecific(st->key, cache);
+    } else if (cache->gen != __atomic_load_n(&st->gen, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&st->lock);
+        __static_cache_reset(cache, st);
+        pthread_mutex_unlock(&st->lock);
+    }
+    return cache;
+}
+
+/* look path up in the cache of the calling thread, revalidating entries
+ * past their ttl with a stat(). Returns a file with a reference held for
+ * the caller. */
+static struct libhttpd_static_file *
+__static_get(struct libhttpd_static *st, const char *path, int64_t now, int *err) {
+    struct libhttpd_static_cache *cache;
+    struct libhttpd_static_file *file;
+    char full[LIBHTTPD_STATIC_PATH_LEN*2];
+    unsigned hash;
+    struct stat sb;
+
+    cache = __static_cache(st);
+    if (cache->max <= 0) return __static_open(st, path, err);
+
+    hash = __static_hash(path);
+    file = __static_lookup(cache, path, hash);
+    if (file && now >= file->expire) {
+        snprintf(full, sizeof(full), "%s/%s", st->root, path);
+        if (stat(full, &sb) == 0 && sb.st_dev == file->dev && sb.st_ino == file->ino
+            && sb.st_mtime == file->mtime && sb.st_size == file->size) {
+            file->expire = now+cache->ttl;
+        } else {
+            __static_evict(cache, file);
+            file = 0;
+        }
+    }
+    if (file) {
+        __static_lru_unlink(cache, file);
+        __static_lru_push(cache, file);
+        __atomic_add_fetch(&file->ref, 1, __ATOMIC_RELAXED);
+        return file;
+    }
+
+    if (!(file = __static_open(st, path, err))) return 0;
+    __static_insert(cache, file, now);
+    return file;
+}
+
+static void
+__static_error(struct libhttpd_response *res, int status, const char *msg) {
+    libhttpd_response_header(res, "Content-Type", "text/plain");
+    libhttpd_response_write(res, msg, strlen(msg));
+    libhttpd_response_end(res, status);
+}
+
+struct libhttpd_static *libhttpd_static_create(const char *prefix, const char *root) {
+    struct libhttpd_static *st;
+
+    st = (struct libhttpd_static *)libhttpd_malloc(sizeof *st);
+    memset(st, 0, sizeof *st);
+    st->prefix = __static_strdup(prefix ? prefix : "/");
+    st->prefix_len = strlen(st->prefix);
+    st->root = __static_strdup(root);
+    pthread_mutex_init(&st->lock, 0);
+    pthread_key_create(&st->key, __static_cache_exit);
+    return st;
+}
+
+/* each thread picks the new settings up on its next lookup. */
+void libhttpd_static_cache(struct libhttpd_static *st, int max, int ttl) {
+    pthread_mutex_lock(&st->lock);
+    st->max = max > 0 ? max : 0;
+    st->ttl = ttl;
+    __atomic_add_fetch(&st->gen, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&st->lock);
+}
+
+int libhttpd_static_serve(struct libhttpd_static *st, struct libhttpd_request *req, struct libhttpd_response *res) {
+    struct libhttpd_static_file *file;
+    char path[LIBHTTPD_STATIC_PATH_LEN];
+    const char *url, *since;
+    time_t date;
+    int err = 0;
+
+    /* "/static" serves "/static", "/static/..." and "/static?..." only. */
+    url = libhttpd_request_url(req);
+    if (strncmp(url, st->prefix, st->prefix_len) != 0) return 0;
+    if (st->prefix_len && st->prefix[st->prefix_len-1] != '/'
+        && url[st->prefix_len] && !strchr("/?#", url[st->prefix_len])) return 0;
+
+    /* HEAD answers with the headers of GET, libhttpd drops the body. */
+    if (strcmp(libhttpd_request_method(req), "GET") != 0
+        && strcmp(libhttpd_request_method(req), "HEAD") != 0) {
+        libhttpd_response_header(res, "Allow", "GET, HEAD");
+        __static_error(res, 405, "Method Not Allowed");
+        return 1;
+    }
+    if (__static_path(st, url, path, sizeof(path)) != 0) {
+        __static_error(res, 400, "Bad Request");
+        return 1;
+    }
+    if (!(file = __static_get(st, path, libhttpd_request_now(req), &err))) {
+        if (err == EACCES) __static_error(res, 403, "Forbidden");
+        else __static_error(res, 404, "Not Found");
+        return 1;
+    }
+
+    libhttpd_response_header(res, "Content-Type", file->mime);
+    libhttpd_response_header(res, "Last-Modified", file->last_modified);
+    /* not modified since a date the client got from us or any later one. */
+    since = libhttpd_request_header_id(req, LIBHTTPD_HEADER_IF_MODIFIED_SINCE);
+    if (since && __static_date(since, &date) == 0 && file->mtime <= date) {
+        __static_unref(file);
+        libhttpd_response_end(res, 304);
+        return 1;
+    }
+    libhttpd_response_sendfile_ref(res, file->fd, 0, file->size, __static_sendfile_done, file);
+    libhttpd_response_end(res, 200);
+    return 1;
+}
+
+void libhttpd_static_handler(void *ud, struct libhttpd_request *req, struct libhttpd_response *res) {
+    if (!libhttpd_static_serve((struct libhttpd_static *)ud, req, res)) {
+        __static_error(res, 404, "Not Found");
+    }
+}
+
+void libhttpd_static_destroy(struct libhttpd_static *st) {
+    struct libhttpd_static_cache *cache;
+
+    /* no exit destructor runs once the key is gone. */
+    pthread_key_delete(st->key);
+    pthread_mutex_lock(&st->lock);
+    while ((cache = st->caches)) {
+        st->caches = cache->next;
+        __static_cache_free(cache);
+    }
+    pthread_mutex_unlock(&st->lock);
+    pthread_mutex_destroy(&st->lock);
+    libhttpd_free(st->prefix);
+    libhttpd_free(st->root);
+    libhttpd_free(st);
+}
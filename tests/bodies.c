@@ -0,0 +1,103 @@
+/*
+ * bodies.c -- request heads and bodies split over reads, and their limit.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Request heads are parsed in place in the input block, so a head split
+ * over reads must keep the fields already seen when the rest arrives.
+ * Bodies with a length or chunked are handed over whole, and a body over
+ * max_body is answered with 413 without being buffered.
+ */
+
+#include "test.h"
+
+#define MAX_BODY 16
+
+static void
+handler(void *ud, struct libhttpd_request *req, struct libhttpd_response *res) {
+    const char *body, *check;
+    int size = 0;
+
+    (void)ud;
+    if (0 == strcmp(libhttpd_request_url(req), "/check")) {
+        check = libhttpd_request_header(req, "X-Check");
+        libhttpd_response_write(res, check ? check : "none", check ? strlen(check) : 4);
+    } else {
+        body = libhttpd_request_body(req, &size);
+        libhttpd_response_write(res, body, size);
+    }
+    libhttpd_response_end(res, 200);
+}
+
+/* send each piece in a read of its own, then expect the response. */
+static void
+request(const char **pieces, int n, const char *expect) {
+    int fd, i;
+
+    CHECK((fd = test_connect()) != -1);
+    for (i = 0; i < n; i++) {
+        test_send(fd, pieces[i]);
+        usleep(10000);
+    }
+    CHECK(test_expect(fd, expect));
+    close(fd);
+}
+
+int
+main(void) {
+    const char *length[] = {
+        "POST /echo HTTP/1.1\r\nHost: a\r\nContent-Length: 10\r\n\r\nhello",
+        "world",
+    };
+    const char *chunked[] = {
+        "POST /echo HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhel",
+        "lo\r\n5\r\nworld\r\n",
+        "0\r\n\r\n",
+    };
+    const char *head[] = {
+        "GET /check HTTP/1.1\r\nHo",
+        "st: a\r\nX-Che",
+        "ck: ke",
+        "pt\r\n\r\n",
+    };
+    const char *over_length[] = {
+        "POST /echo HTTP/1.1\r\nHost: a\r\nContent-Length: 17\r\n\r\n",
+    };
+    const char *over_chunked[] = {
+        "POST /echo HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\n",
+        "a\r\n0123456789\r\n",
+        "a\r\n0123456789\r\n0\r\n\r\n",
+    };
+
+    libhttpd__max_body(MAX_BODY);
+    test_serve(handler);
+
+    request(length, 2, "Content-Length: 10\r\n\r\nhelloworld");
+    request(chunked, 3, "Content-Length: 10\r\n\r\nhelloworld");
+    request(head, 4, "Content-Length: 4\r\n\r\nkept");
+    request(over_length, 1, "HTTP/1.1 413");
+    request(over_chunked, 3, "HTTP/1.1 413");
+
+    printf("bodies ok\n");
+    return 0;
+}
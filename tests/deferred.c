@@ -0,0 +1,149 @@
+/*
+ * deferred.c -- deferred responses completed after the callback returned.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * A deferred response outlives its callback and is completed later, from
+ * the loop or from any other thread. A streamed response ends with
+ * libhttpd_response_end(res, 0), its status being ignored. Ended from
+ * another thread it must still send the last chunk and let the pipelined
+ * response behind it go out.
+ */
+
+#include "test.h"
+
+#include <pthread.h>
+
+static void *
+complete(void *ud) {
+    struct libhttpd_response *res = (struct libhttpd_response *)ud;
+
+    usleep(20000);
+    libhttpd_response_write(res, "abc", 3);
+    libhttpd_response_end(res, 200);
+    return 0;
+}
+
+static void *
+stream(void *ud) {
+    struct libhttpd_response *res = (struct libhttpd_response *)ud;
+
+    usleep(20000);
+    libhttpd_response_begin(res, 200);
+    libhttpd_response_write(res, "abc", 3);
+    libhttpd_response_write(res, "def", 3);
+    libhttpd_response_end(res, 200);
+    return 0;
+}
+
+static void *
+finish(void *ud) {
+    struct libhttpd_response *res = (struct libhttpd_response *)ud;
+
+    usleep(20000);
+    libhttpd_response_write(res, "def", 3);
+    libhttpd_response_end(res, 0);
+    return 0;
+}
+
+static void *
+stream_zero(void *ud) {
+    struct libhttpd_response *res = (struct libhttpd_response *)ud;
+
+    libhttpd_response_begin(res, 200);
+    return finish(res);
+}
+
+static void
+handler(void *ud, struct libhttpd_request *req, struct libhttpd_response *res) {
+    const char *url = libhttpd_request_url(req);
+    pthread_t t;
+
+    (void)ud;
+    if (0 == strcmp(url, "/plain")) {
+        libhttpd_response_write(res, "ok", 2);
+        libhttpd_response_end(res, 200);
+        return;
+    }
+    libhttpd_response_defer(res);
+    if (0 == strcmp(url, "/inline")) {
+        libhttpd_response_write(res, "ok", 2);
+        libhttpd_response_end(res, 200);
+        return;
+    }
+    if (0 == strcmp(url, "/thread")) {
+        pthread_create(&t, 0, complete, res);
+    } else if (0 == strcmp(url, "/stream")) {
+        pthread_create(&t, 0, stream, res);
+    } else if (0 == strcmp(url, "/begun")) {
+        /* begun on the loop, ended off it. */
+        libhttpd_response_begin(res, 200);
+        libhttpd_response_write(res, "abc", 3);
+        pthread_create(&t, 0, finish, res);
+    } else {
+        pthread_create(&t, 0, stream_zero, res);
+    }
+    pthread_detach(t);
+}
+
+/* one request on a new connection, its response must contain expect. */
+static void
+request(const char *url, const char *expect) {
+    char buff[256];
+    int fd;
+
+    CHECK((fd = test_connect()) != -1);
+    snprintf(buff, sizeof(buff), "GET %s HTTP/1.1\r\nHost: a\r\n\r\n", url);
+    test_send(fd, buff);
+    CHECK(test_expect(fd, expect));
+    close(fd);
+}
+
+int
+main(void) {
+    int fd;
+
+    test_serve(handler);
+
+    request("/inline", "Content-Length: 2\r\n\r\nok");
+    request("/thread", "Content-Length: 3\r\n\r\nabc");
+    request("/stream", "3\r\nabc\r\n3\r\ndef\r\n0\r\n\r\n");
+
+    /* ended with a status of 0 off the loop. */
+    CHECK((fd = test_connect()) != -1);
+    test_send(fd, "GET /begun HTTP/1.1\r\nHost: a\r\n\r\n"
+                  "GET /plain HTTP/1.1\r\nHost: a\r\n\r\n");
+    CHECK(test_expect(fd, "3\r\nabc\r\n3\r\ndef\r\n0\r\n\r\n"));
+    CHECK(test_expect(fd, "Content-Length: 2\r\n\r\nok"));
+    close(fd);
+
+    CHECK((fd = test_connect()) != -1);
+    test_send(fd, "GET /stream-zero HTTP/1.1\r\nHost: a\r\n\r\n"
+                  "GET /plain HTTP/1.1\r\nHost: a\r\n\r\n");
+    CHECK(test_expect(fd, "3\r\ndef\r\n0\r\n\r\n"));
+    CHECK(test_expect(fd, "Content-Length: 2\r\n\r\nok"));
+    close(fd);
+
+    printf("deferred ok\n");
+    return 0;
+}
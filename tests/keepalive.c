@@ -0,0 +1,93 @@
+/*
+ * keepalive.c -- connection reuse, idle timeout and request limit.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * A keep-alive connection stays open between requests until it has been
+ * idle for the keepalive timeout. HTTP/1.0 clients not asking for
+ * keep-alive, and the last request allowed by max_requests, are answered
+ * with Connection: close and the connection ends there.
+ */
+
+#include "test.h"
+
+#define KEEPALIVE 1
+#define MAX_REQUESTS 3
+
+static void
+handler(void *ud, struct libhttpd_request *req, struct libhttpd_response *res) {
+    const char *url = libhttpd_request_url(req);
+
+    (void)ud;
+    libhttpd_response_write(res, url, strlen(url));
+    libhttpd_response_end(res, 200);
+}
+
+int
+main(void) {
+    int fd;
+
+    libhttpd__keepalive(KEEPALIVE);
+    libhttpd__max_requests(MAX_REQUESTS);
+    test_serve(handler);
+
+    /* open between requests, closed once idle for longer than keepalive. */
+    CHECK((fd = test_connect()) != -1);
+    test_send(fd, "GET /1 HTTP/1.1\r\nHost: a\r\n\r\n");
+    CHECK(test_expect(fd, "Content-Length: 2\r\n\r\n/1"));
+    usleep(KEEPALIVE*1000000/2);
+    test_send(fd, "GET /2 HTTP/1.1\r\nHost: a\r\n\r\n");
+    CHECK(test_expect(fd, "Content-Length: 2\r\n\r\n/2"));
+    CHECK(test_eof(fd));
+    close(fd);
+
+    CHECK((fd = test_connect()) != -1);
+    test_send(fd, "GET /1 HTTP/1.0\r\n\r\n");
+    CHECK(test_expect(fd, "Connection: close\r\n"));
+    CHECK(test_expect(fd, "\r\n\r\n/1"));
+    CHECK(test_eof(fd));
+    close(fd);
+
+    CHECK((fd = test_connect()) != -1);
+    test_send(fd, "GET /1 HTTP/1.0\r\nConnection: keep-alive\r\n\r\n");
+    CHECK(test_expect(fd, "\r\n\r\n/1"));
+    test_send(fd, "GET /2 HTTP/1.0\r\nConnection: keep-alive\r\n\r\n");
+    CHECK(test_expect(fd, "\r\n\r\n/2"));
+    close(fd);
+
+    /* the last request allowed is answered with Connection: close. */
+    CHECK((fd = test_connect()) != -1);
+    test_send(fd, "GET /1 HTTP/1.1\r\nHost: a\r\n\r\n"
+                  "GET /2 HTTP/1.1\r\nHost: a\r\n\r\n"
+                  "GET /3 HTTP/1.1\r\nHost: a\r\n\r\n"
+                  "GET /4 HTTP/1.1\r\nHost: a\r\n\r\n");
+    CHECK(test_expect(fd, "Content-Length: 2\r\n\r\n/1"));
+    CHECK(test_expect(fd, "Content-Length: 2\r\n\r\n/2"));
+    CHECK(test_expect(fd, "Connection: close\r\n"));
+    CHECK(test_expect(fd, "Content-Length: 2\r\n\r\n/3"));
+    CHECK(test_eof(fd));
+    close(fd);
+
+    printf("keepalive ok\n");
+    return 0;
+}
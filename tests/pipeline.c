@@ -0,0 +1,92 @@
+/*
+ * pipeline.c -- pipelined requests answered in order.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Requests pipelined in one write are answered in request order, even
+ * when an earlier response is deferred and completed last, from another
+ * thread. A request asking for Connection: close is the last one
+ * answered, the requests behind it are dropped with the connection.
+ */
+
+#include "test.h"
+
+#include <pthread.h>
+
+static void *
+complete(void *ud) {
+    struct libhttpd_response *res = (struct libhttpd_response *)ud;
+
+    usleep(50000);
+    libhttpd_response_write(res, "deferred", 8);
+    libhttpd_response_end(res, 200);
+    return 0;
+}
+
+static void
+handler(void *ud, struct libhttpd_request *req, struct libhttpd_response *res) {
+    const char *url = libhttpd_request_url(req);
+    pthread_t t;
+
+    (void)ud;
+    if (0 == strcmp(url, "/defer")) {
+        libhttpd_response_defer(res);
+        pthread_create(&t, 0, complete, res);
+        pthread_detach(t);
+        return;
+    }
+    libhttpd_response_write(res, url, strlen(url));
+    libhttpd_response_end(res, 200);
+}
+
+int
+main(void) {
+    int fd;
+
+    test_serve(handler);
+
+    CHECK((fd = test_connect()) != -1);
+    test_send(fd, "GET /defer HTTP/1.1\r\nHost: a\r\n\r\n"
+                  "GET /1 HTTP/1.1\r\nHost: a\r\n\r\n"
+                  "GET /2 HTTP/1.1\r\nHost: a\r\n\r\n"
+                  "GET /3 HTTP/1.1\r\nHost: a\r\n\r\n");
+    CHECK(test_expect(fd, "Content-Length: 8\r\n\r\ndeferred"));
+    CHECK(test_expect(fd, "Content-Length: 2\r\n\r\n/1"));
+    CHECK(test_expect(fd, "Content-Length: 2\r\n\r\n/2"));
+    CHECK(test_expect(fd, "Content-Length: 2\r\n\r\n/3"));
+    close(fd);
+
+    /* nothing after the request asking to close is answered. */
+    CHECK((fd = test_connect()) != -1);
+    test_send(fd, "GET /defer HTTP/1.1\r\nHost: a\r\n\r\n"
+                  "GET /1 HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n"
+                  "GET /2 HTTP/1.1\r\nHost: a\r\n\r\n");
+    CHECK(test_expect(fd, "Content-Length: 8\r\n\r\ndeferred"));
+    CHECK(test_expect(fd, "Connection: close\r\n"));
+    CHECK(test_expect(fd, "Content-Length: 2\r\n\r\n/1"));
+    CHECK(test_eof(fd));
+    close(fd);
+
+    printf("pipeline ok\n");
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * static.c -- static files, conditional requests and cache revalidation.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * If-Modified-Since is compared as a date, in any of the HTTP-date forms,
+ * against the mtime of the file. A cached file changed on disk is served
+ * anew once its ttl passed.
+ */
+
+#include "test.h"
+
+#include <sys/stat.h>
+
+/* Sun, 09 Sep 2001 01:46:40 GMT */
+#define MTIME 1000000000
+
+static struct libhttpd_static *st;
+static char root[64];
+
+static void
+handler(void *ud, struct libhttpd_request *req, struct libhttpd_response *res) {
+    (void)ud;
+    libhttpd_static_handler(st, req, res);
+}
+
+static void
+put(const char *data) {
+    struct timeval tv[2] = {{MTIME, 0}, {MTIME, 0}};
+    char path[128];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/f.txt", root);
+    CHECK((f = fopen(path, "w")) != 0);
+    fputs(data, f);
+    fclose(f);
+    CHECK(utimes(path, tv) == 0);
+}
+
+static void
+cleanup(void) {
+    char path[128];
+
+    snprintf(path, sizeof(path), "%s/f.txt", root);
+    unlink(path);
+    rmdir(root);
+}
+
+static void
+request(const char *method, const char *since, const char *expect) {
+    char buff[256];
+    int fd;
+
+    CHECK((fd = test_connect()) != -1);
+    if (since) {
+        snprintf(buff, sizeof(buff), "%s /f.txt HTTP/1.1\r\nHost: a\r\nIf-Modified-Since: %s\r\n\r\n", method, since);
+    } else {
+        snprintf(buff, sizeof(buff), "%s /f.txt HTTP/1.1\r\nHost: a\r\n\r\n", method);
+    }
+    test_send(fd, buff);
+    CHECK(test_expect(fd, expect));
+    close(fd);
+}
+
+int
+main(void) {
+    snprintf(root, sizeof(root), "/tmp/libhttpd-static-%d", (int)getpid());
+    CHECK(mkdir(root, 0755) == 0);
+    atexit(cleanup);
+    put("hello");
+
+    st = libhttpd_static_create("/", root);
+    /* stat() on every hit, a change shows up on the next request. */
+    libhttpd_static_cache(st, 4, 0);
+    test_serve(handler);
+
+    request("GET", 0, "Last-Modified: Sun, 09 Sep 2001 01:46:40 GMT\r\n");
+    request("GET", 0, "Content-Length: 5\r\n\r\nhello");
+    request("GET", "Sun, 09 Sep 2001 01:46:40 GMT", "HTTP/1.1 304");
+    request("GET", "Fri, 01 Jan 2100 00:00:00 GMT", "HTTP/1.1 304");
+    request("GET", "Sunday, 09-Sep-01 01:46:40 GMT", "HTTP/1.1 304");
+    request("GET", "Sun Sep  9 01:46:40 2001", "HTTP/1.1 304");
+    request("GET", "Sun Sep  9 01:46:39 2001", "Content-Length: 5\r\n\r\nhello");
+    request("GET", "Sun, 09 Sep 2001 01:46:39 GMT", "Content-Length: 5\r\n\r\nhello");
+    request("GET", "yesterday", "Content-Length: 5\r\n\r\nhello");
+    request("HEAD", 0, "Content-Length: 5\r\n");
+
+    put("hello, again");
+    request("GET", 0, "Content-Length: 12\r\n\r\nhello, again");
+
+    printf("static ok\n");
+    return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * test.h -- helpers for the libhttpd regression tests.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Each test forks a server running libhttpd__serve on a port picked from
+ * its pid, talks to it over raw sockets and kills it at exit. The client
+ * side reads with a timeout, so a stalled response fails the test instead
+ * of hanging it.
+ */
+
+#ifndef _LIBHTTPD_TEST_H
+#define _LIBHTTPD_TEST_H
+
+#include "libhttpd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define TEST_RECV_TIMEOUT 3
+
+static int test_port;
+static pid_t test_server;
+static char test_input[65536];
+static int test_input_len;
+static int test_input_fd = -1;
+
+#define CHECK(cond) do {                                                    \
+    if (!(cond)) {                                                          \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        exit(1);                                                            \
+    }                                                                       \
+} while (0)
+
+static void
+test_stop(void) {
+    if (test_server > 0) {
+        kill(test_server, SIGKILL);
+        waitpid(test_server, 0, 0);
+        test_server = 0;
+    }
+}
+
+static int
+test_connect(void) {
+    struct sockaddr_in sa;
+    struct timeval tv = {TEST_RECV_TIMEOUT, 0};
+    int fd, yes = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(test_port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    /* a new connection reusing the fd number starts with no input. */
+    if (fd == test_input_fd) test_input_fd = -1;
+    return fd;
+}
+
+/* fork a server calling cb and wait until it accepts connections. */
+static void
+test_serve(libhttpd_cb cb) {
+    int i, fd;
+
+    signal(SIGPIPE, SIG_IGN);
+    test_port = 20000 + getpid() % 20000;
+    if ((test_server = fork()) == 0) {
+        libhttpd__loglevel(LIBHTTPD_LOG_ERROR);
+        libhttpd__serve("127.0.0.1", test_port, 0, cb);
+        _exit(0);
+    }
+    atexit(test_stop);
+    for (i = 0; i < 100; i++) {
+        if ((fd = test_connect()) != -1) {
+            close(fd);
+            return;
+        }
+        usleep(20000);
+    }
+    fprintf(stderr, "server did not start on port %d\n", test_port);
+    exit(1);
+}
+
+static void
+test_send(int fd, const char *data) {
+    CHECK(write(fd, data, strlen(data)) == (ssize_t)strlen(data));
+}
+
+/* read until expect was received and return 1, the bytes after it are kept
+ * for the next call on the same connection. */
+static int
+test_expect(int fd, const char *expect) {
+    char *p;
+    int n;
+
+    if (fd != test_input_fd) {
+        test_input_fd = fd;
+        test_input_len = 0;
+    }
+    for (;;) {
+        test_input[test_input_len] = 0;
+        if ((p = strstr(test_input, expect))) {
+            p += strlen(expect);
+            test_input_len -= p-test_input;
+            memmove(test_input, p, test_input_len);
+            return 1;
+        }
+        if (test_input_len == (int)sizeof(test_input)-1) break;
+        n = read(fd, test_input+test_input_len, sizeof(test_input)-1-test_input_len);
+        if (n <= 0) break;
+        test_input_len += n;
+    }
+    fprintf(stderr, "expected \"%s\", got \"%s\"\n", expect, test_input);
+    return 0;
+}
+
+/* return 1 if the server closes the connection without sending more, a
+ * reset for input it did not read counting as closed. */
+static int
+test_eof(int fd) {
+    char buff[1024];
+    int n;
+
+    if (fd == test_input_fd && test_input_len > 0) {
+        test_input[test_input_len] = 0;
+        fprintf(stderr, "expected eof, got \"%s\"\n", test_input);
+        return 0;
+    }
+    n = read(fd, buff, sizeof(buff)-1);
+    if (n == 0 || (n == -1 && errno == ECONNRESET)) return 1;
+    if (n > 0) {
+        buff[n] = 0;
+        fprintf(stderr, "expected eof, got \"%s\"\n", buff);
+    } else {
+        fprintf(stderr, "expected eof, got none in %ds\n", TEST_RECV_TIMEOUT);
+    }
+    return 0;
+}
+
+#endif /* _LIBHTTPD_TEST_H */
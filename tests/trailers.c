@@ -0,0 +1,87 @@
+/*
+ * trailers.c -- chunked request bodies with trailers split over reads.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Trailers arrive after the request head was parsed in place and its input
+ * block handed on. Sent in pieces, one read each, they must not touch the
+ * input still to be parsed, here the request pipelined behind them. Sent
+ * interleaved over several connections, input blocks get recycled in
+ * between and they must not touch another connection's input either.
+ */
+
+#include "test.h"
+
+#define CONNS 4
+
+static const char *pieces[] = {
+    "POST /t HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n",
+    "0\r\nX-Trailer-Name-",
+    "Continued: va",
+    "lue\r\n\r\nGET /after HTTP/1.1\r\nHost: a\r\nX-Check: kept\r\n\r\n",
+};
+
+static void
+handler(void *ud, struct libhttpd_request *req, struct libhttpd_response *res) {
+    const char *body, *check;
+    int size = 0;
+
+    (void)ud;
+    if (0 == strcmp(libhttpd_request_url(req), "/after")) {
+        check = libhttpd_request_header(req, "X-Check");
+        libhttpd_response_write(res, check ? check : "none", check ? strlen(check) : 4);
+    } else {
+        body = libhttpd_request_body(req, &size);
+        libhttpd_response_write(res, body, size);
+    }
+    libhttpd_response_end(res, 200);
+}
+
+static void
+run(int conns) {
+    int fds[CONNS], i, j;
+
+    for (i = 0; i < conns; i++) CHECK((fds[i] = test_connect()) != -1);
+    for (j = 0; j < (int)(sizeof(pieces)/sizeof(pieces[0])); j++) {
+        for (i = 0; i < conns; i++) {
+            test_send(fds[i], pieces[j]);
+            usleep(10000);
+        }
+    }
+    for (i = 0; i < conns; i++) {
+        CHECK(test_expect(fds[i], "Content-Length: 5\r\n\r\nhello"));
+        CHECK(test_expect(fds[i], "Content-Length: 4\r\n\r\nkept"));
+        close(fds[i]);
+    }
+}
+
+int
+main(void) {
+    test_serve(handler);
+
+    run(1);
+    run(CONNS);
+
+    printf("trailers ok\n");
+    return 0;
+}